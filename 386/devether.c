@@ -130,8 +130,15 @@ etherrtrace(Netfile* f, Etherpkt* pkt, int len)
 	qpass(f->iq, bp);
 }
 
-Block*
-etheriq(Ether* ether, Block* bp, int fromwire)
+/*
+ * Multiplex the packet to all the connections which want it.
+ * If the packet is not to be used subsequently (fromwire != 0),
+ * return the connection that should get bp itself, thereby
+ * saving a copy of the data (usual case hopefully); the others
+ * get copies.  Return -1 if nobody wants the packet.
+ */
+static int
+etherdemux(Ether* ether, Block* bp, int fromwire, Netfile **fxp)
 {
 	Etherpkt *pkt;
 	ushort type;
@@ -150,25 +157,14 @@ etheriq(Ether* ether, Block* bp, int fromwire)
 	multi = pkt->d[0] & 1;
 	/* check for valid multcast addresses */
 	if(multi && memcmp(pkt->d, ether->bcast, sizeof(pkt->d)) != 0 && ether->prom == 0){
-		if(!activemulti(ether, pkt->d, sizeof(pkt->d))){
-			if(fromwire){
-				freeb(bp);
-				bp = 0;
-			}
-			return bp;
-		}
+		if(!activemulti(ether, pkt->d, sizeof(pkt->d)))
+			return -1;
 	}
 
 	/* is it for me? */
 	tome = memcmp(pkt->d, ether->ea, sizeof(pkt->d)) == 0;
 	fromme = memcmp(pkt->s, ether->ea, sizeof(pkt->s)) == 0;
 
-	/*
-	 * Multiplex the packet to all the connections which want it.
-	 * If the packet is not to be used subsequently (fromwire != 0),
-	 * attempt to simply pass it into one of the connections, thereby
-	 * saving a copy of the data (usual case hopefully).
-	 */
 	for(fp = ether->f; fp < ep; fp++){
 		if(f = *fp)
 		if(f->type == type || f->type < 0)
@@ -192,18 +188,61 @@ etheriq(Ether* ether, Block* bp, int fromwire)
 				etherrtrace(f, pkt, len);
 		}
 	}
+	*fxp = fx;
+	return 0;
+}
 
-	if(fx){
-		if(qpass(fx->iq, bp) < 0)
-			ether->soverflows++;
-		return 0;
-	}
-	if(fromwire){
-		freeb(bp);
-		return 0;
+Block*
+etheriq(Ether* ether, Block* bp, int fromwire)
+{
+	Netfile *fx;
+
+	if(etherdemux(ether, bp, fromwire, &fx) < 0 || fx == 0){
+		if(fromwire){
+			freeb(bp);
+			bp = 0;
+		}
+		return bp;
 	}
+	if(qpass(fx->iq, bp) < 0)
+		ether->soverflows++;
+	return 0;
+}
 
-	return bp;
+/*
+ * Input a list of packets from the wire, linked by next.
+ * Packets for the same connection are passed to its
+ * queue at once, with a single wakeup.
+ */
+void
+etheriqlist(Ether* ether, Block* bp)
+{
+	Netfile *fx, *f[Ntypes];
+	Block *next, *hd[Ntypes], **tl[Ntypes];
+	int i, nf;
+
+	nf = 0;
+	for(; bp != nil; bp = next){
+		next = bp->next;
+		bp->next = nil;
+		if(etherdemux(ether, bp, 1, &fx) < 0 || fx == 0){
+			freeb(bp);
+			continue;
+		}
+		for(i = 0; i < nf; i++)
+			if(f[i] == fx)
+				break;
+		if(i == nf){
+			f[nf] = fx;
+			hd[nf] = nil;
+			tl[nf] = &hd[nf];
+			nf++;
+		}
+		*tl[i] = bp;
+		tl[i] = &bp->next;
+	}
+	for(i = 0; i < nf; i++)
+		ether->soverflows += qpasslist(f[i]->iq, hd[i]);
 }
 
 static int
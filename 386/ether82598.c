@@ -25,6 +25,7 @@ enum {
 	Nrd	= 256,		/* multiple of 8, power of 2 for NEXTPOW2 */
 	Nrb	= 1024,
 	Ntd	= 128,		/* multiple of 8, power of 2 for NEXTPOW2 */
+	Nrxbatch= 32,		/* packets passed to etheriqlist at once */
 	Goslow	= 0,		/* flag: go slow by throttling intrs, etc. */
 };
 
@@ -635,7 +636,8 @@ void
 rproc(void *v)
 {
 	uint m, rdh;
-	Block *b;
+	int n;
+	Block *b, *hd, **tl;
 	Ctlr *c;
 	Ether *e;
 	Rd *r;
@@ -647,6 +649,9 @@ rproc(void *v)
 		replenish(c, rdh);
 		ienable(c, Irx0);
 		sleep(&c->rrendez, rim, c);
+		hd = nil;
+		tl = &hd;
+		n = 0;
 		for (;;) {
 			c->rim = 0;
 			r = c->rdba + rdh;
@@ -659,12 +664,21 @@ rproc(void *v)
 			b->wp += r->length;
 			b->lim = b->wp;			/* lie like a dog */
 //			r->status = 0;
-			etheriq(e, b, 1);
+			*tl = b;
+			tl = &b->next;
+			if(++n == Nrxbatch){
+				etheriqlist(e, hd);
+				hd = nil;
+				tl = &hd;
+				n = 0;
+			}
 			c->rdfree--;
 			rdh = NEXTPOW2(rdh, m);
 			if (c->rdfree <= c->nrd - 16)
 				replenish(c, rdh);
 		}
+		if(hd != nil)
+			etheriqlist(e, hd);
 	}
 }
 
@@ -38,6 +38,7 @@ enum {
 	Maxslots= 1024,
 	Align	= 4096,
 	Maxmtu	= 9000,
+	Nrxbatch= 32,		/* packets passed to etheriqlist at once */
 	Noconf	= 0xffffffff,
 
 	Fwoffset= 1*MiB,
@@ -1090,7 +1091,8 @@ m10rx(void *v)
 {
 	Ether *e;
 	Ctlr *c;
-	Block *b;
+	Block *b, *hd, **tl;
+	int n;
 
 	e = v;
 	c = e->ctlr;
@@ -1098,8 +1100,21 @@ m10rx(void *v)
 		replenish(&c->sm);
 		replenish(&c->bg);
 		sleep(&c->rxrendez, rxcansleep, c);
-		while(b = nextblock(c))
-			etheriq(e, b, 1);
+		hd = nil;
+		tl = &hd;
+		n = 0;
+		while(b = nextblock(c)){
+			*tl = b;
+			tl = &b->next;
+			if(++n == Nrxbatch){
+				etheriqlist(e, hd);
+				hd = nil;
+				tl = &hd;
+				n = 0;
+			}
+		}
+		if(hd != nil)
+			etheriqlist(e, hd);
 	}
 }
 
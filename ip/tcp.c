@@ -587,6 +587,21 @@ tcprcvwin(Conv *s)				/* Call with tcb locked */
 		tcb->rcv.blocked = 1;
 }
 
+/*
+ *  pass the data collected by tcpiput to the receive queue.
+ *  must be done before the queue may be hungup.
+ */
+static void
+tcppassrq(Conv *s, Block **rqbp, Block ***rqtl)	/* Call with tcb locked */
+{
+	if(*rqbp == nil)
+		return;
+	qpassnolim(s->rq, *rqbp);
+	*rqbp = nil;
+	*rqtl = rqbp;
+	tcprcvwin(s);
+}
+
 static void
 tcpacktimer(void *v)
 {
@@ -613,8 +628,14 @@ tcpacktimer(void *v)
 static void
 tcpcreate(Conv *c)
 {
+	char name[32];
+
 	c->rq = qopen(QMAX, Qcoalesce, tcpacktimer, c);
 	c->wq = qopen((3*QMAX)/2, Qkick, tcpkick, c);
+	snprint(name, sizeof name, "%s/%d/rq", c->p->name, c->x);
+	qsetname(c->rq, name);
+	snprint(name, sizeof name, "%s/%d/wq", c->p->name, c->x);
+	qsetname(c->wq, name);
 }
 
 static void
@@ -1954,9 +1975,12 @@ tcpiput(Proto *tcp, Ipifc*, Block *bp)
 	Fs *f;
 	Tcppriv *tpriv;
 	uchar version;
+	Block *rqbp, **rqtl;
 
 	f = tcp->f;
 	tpriv = tcp->priv;
+	rqbp = nil;	/* data for s->rq, passed at once on the way out */
+	rqtl = &rqbp;
 
 	tpriv->stats[InSegs]++;
 
@@ -2092,6 +2116,8 @@ reset:
 	 */
 	tcb = (Tcpctl*)s->ptcl;
 	if(waserror()){
+		/* already acked or about to be; deliver it */
+		tcppassrq(s, &rqbp, &rqtl);
 		qunlock(s);
 		nexterror();
 	}
@@ -2223,6 +2249,7 @@ reset:
 				if(tcb->rcv.nxt != seg.seq)
 					print("out of order RST rcvd: %I.%d -> %I.%d, rcv.nxt %lux seq %lux\n", s->raddr, s->rport, s->laddr, s->lport, tcb->rcv.nxt, seg.seq);
 			}
+			tcppassrq(s, &rqbp, &rqtl);
 			localclose(s, Econrefused);
 			goto raise;
 		}
@@ -2272,6 +2299,7 @@ reset:
 		case Last_ack:
 			update(s, &seg);
 			if(qlen(s->wq)+tcb->flgcnt == 0) {
+				tcppassrq(s, &rqbp, &rqtl);
 				localclose(s, nil);
 				goto raise;
 			}
@@ -2313,7 +2341,10 @@ reset:
 					bp = packblock(bp);
 					if(bp == nil)
 						panic("tcp packblock");
-					qpassnolim(s->rq, bp);
+					*rqtl = bp;
+					while(bp->next != nil)
+						bp = bp->next;
+					rqtl = &bp->next;
 					bp = nil;
 
 					/*
@@ -2333,9 +2364,9 @@ reset:
 				tcb->rcv.nxt += length;
 
 				/*
-				 *  update our rcv window
+				 *  our rcv window is updated once
+				 *  the data is in s->rq
 				 */
-				tcprcvwin(s);
 
 				/*
 				 *  turn on the acktimer if there's something
@@ -2351,6 +2382,7 @@ reset:
 					freeblist(bp);
 				sndrst(tcp, source, dest, length, &seg, version,
 					"send to Finwait2");
+				tcppassrq(s, &rqbp, &rqtl);
 				qunlock(s);
 				poperror();
 				return;
@@ -2359,6 +2391,8 @@ reset:
 
 		if(seg.flags & FIN) {
 			tcb->flags |= FORCE;
+			/* Close_wait hangs up s->rq */
+			tcppassrq(s, &rqbp, &rqtl);
 
 			switch(tcb->state) {
 			case Syn_received:
@@ -2416,11 +2450,13 @@ reset:
 		}
 	}
 output:
+	tcppassrq(s, &rqbp, &rqtl);
 	tcpoutput(s);
 	qunlock(s);
 	poperror();
 	return;
 raise:
+	tcppassrq(s, &rqbp, &rqtl);
 	qunlock(s);
 	poperror();
 	freeblist(bp);
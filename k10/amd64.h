@@ -29,6 +29,7 @@ enum {						/* Cr4 */
 	Pce		= 0x00000100,		/* Performance Monitoring Counter Enable */
 	Osfxsr		= 0x00000200,		/* FXSAVE/FXRSTOR Support */
 	Osxmmexcpt	= 0x00000400,		/* Unmasked Exception Support */
+	Pcide		= 0x00020000,		/* Process-Context Identifiers */
 };
 
 enum {						/* Rflags */
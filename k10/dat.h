@@ -83,6 +83,9 @@ struct PFPU {
 struct PMMU
 {
 	Page*	mmuptp[4];		/* page table pages for each level */
+	int	pcid;			/* valid if pcidmach/pcidgen match */
+	int	pcidmach;
+	int	pcidgen;
 };
 
 /*
@@ -150,6 +153,12 @@ struct MMMU
 	int	npgsz;
 
 	Page	pml4kludge;		/* GAK: we need a page */
+
+	int	pcidok;			/* Pcide set */
+	int	pcidgen;		/* generation for PCIDs handed out */
+	int	pcidnext;
+	ulong	npcidhit;		/* switches keeping the TLB */
+	ulong	npcidalloc;
 };
 
 /*
@@ -197,6 +206,12 @@ struct Mach
 	int	load;
 	int	intr;
 	int	mmuflush;		/* make current proc flush it's mmu state */
+	Lock	shootlock;		/* TLB shootdown request (mmu.c) */
+	uintptr	shootva;		/* range to flush for mmuflush */
+	uintptr	shoottop;
+	ulong	nshootsent;
+	ulong	nshootrecv;
+	ulong	nshootfull;
 	int	ilockdepth;
 	uintptr	ilockpc;
 	Perf	perf;			/* performance counters */
@@ -45,6 +45,7 @@ struct Etherpkt
 };
 
 extern Block* etheriq(Ether*, Block*, int);
+extern void etheriqlist(Ether*, Block*);
 extern void addethercard(char*, int(*)(Ether*));
 extern ulong ethercrc(uchar*, int);
 extern int parseether(uchar*, char*);
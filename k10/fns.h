@@ -77,6 +77,7 @@ void	mfence(void);
 void	mmuflushpg(Page*);
 void	mmuflushtlb(u64int);
 void	mmuinit(void);
+void	mmushootintr(Ureg*, void*);
 u64int	mmuphysaddr(uintptr);
 int	mmuwalk(uintptr, int, PTE**, u64int (*)(usize));
 int	multiboot(u32int, u32int, int);
@@ -186,6 +187,7 @@ uintptr	PADDR(void*);
 extern int apiceoi(int);
 extern void apicinit(int, uintptr, int);
 extern int apicisr(int);
+extern void apicipi(int);
 extern int apiconline(void);
 extern void apicsipi(int, uintptr);
 extern void apictimerdisable(void);
@@ -241,6 +241,7 @@ main(u32int ax, u32int bx)
 	mpsinit();
 	apiconline();
 	intrenable(IdtTIMER, apictimerintr, 0, -1, "APIC timer");
+	intrenable(IdtIPI, mmushootintr, 0, -1, "TLB shootdown");
 	apictimerenable();
 	apictprput(0);
 
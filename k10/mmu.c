@@ -13,6 +13,7 @@
 #define PDX(v)		PTLX((v), 1)
 #define PTX(v)		PTLX((v), 0)
 #define PPN(p)		((p)->pa & ~((1<<(p)->pgszlg2)-1))
+#define PTEADDR(e)	((e) & ~(PteNX|(PGSZ-1)))
 
 #define VMAP		(0xffffffffe0000000ull)
 #define VMAPSZ		(256*MiB)
@@ -28,6 +29,13 @@
 			|(((va) & 0xffffffffffffull)>>(((l)+1)*PTSHFT))\
 			& ~0xfffull))
 
+#define CR3NOFLUSH	(1ull<<63)	/* keep TLB entries for the PCID */
+
+enum
+{
+	Npcid = 4096,
+};
+
 typedef struct Ptpalloc Ptpalloc;
 
 struct Ptpalloc
@@ -100,11 +108,80 @@ mmuptprelease(Page *p)
 	unlock(&ptpalloc);
 }
 
+/*
+ * PCIDs.
+ * Each mach hands out PCIDs to the processes it runs, so
+ * switching back to a process keeps its TLB entries.
+ * A process keeps its PCID while it runs on the same mach and
+ * the mach does not start a new generation; its entries may be
+ * stale once it ran elsewhere.
+ * Loading a PCID without CR3NOFLUSH flushes whatever was
+ * cached for it, which is done the first time it is handed out
+ * in a generation, so wrapping needs no flush.
+ * PCID 0 is used when there is no process loaded (mmuflushtlb) and
+ * is always flushed, as the PML4 may hold stale user entries
+ * while it is loaded.
+ * Returns the bits for cr3.
+ */
+static u64int
+mmupcid(Proc *p, int flush)
+{
+	if(!m->pcidok)
+		return 0;
+	if(p->pcidmach != m->machno || p->pcidgen != m->pcidgen){
+		if(m->pcidnext >= Npcid){
+			m->pcidgen++;
+			m->pcidnext = 1;
+		}
+		p->pcid = m->pcidnext++;
+		p->pcidmach = m->machno;
+		p->pcidgen = m->pcidgen;
+		m->npcidalloc++;
+		return p->pcid;
+	}
+	if(flush)
+		return p->pcid;
+	m->npcidhit++;
+	return p->pcid|CR3NOFLUSH;
+}
+
+static void
+mmupcidinit(void)
+{
+	if(getconf("*nopcid") != nil)
+		return;
+	/* Pcid bit in function 1 CX */
+	if(m->ncpuinfos == 0 || !(m->cpuinfo[1][2] & 0x00020000))
+		return;
+	m->pcidgen = 1;
+	m->pcidnext = 1;
+	cr4put(cr4get()|Pcide);
+	m->pcidok = 1;
+}
+
 static char*
 ptpsummary(char *s, char *e, void*)
 {
-	return seprint(s, e, "%ld/%ld mmu %d pages\n",
+	int i;
+	Mach *mp;
+
+	s = seprint(s, e, "%ld/%ld mmu %d pages\n",
 		ptpalloc.nused, ptpalloc.nused+ptpalloc.nfree, PTSZ);
+	for(i = 0; i < MACHMAX; i++){
+		if((mp = sys->machptr[i]) == nil || !mp->online)
+			continue;
+		if(mp->nshootsent == 0 && mp->nshootrecv == 0)
+			continue;
+		s = seprint(s, e, "mach%d: %lud shootdowns sent %lud recv %lud full\n",
+			i, mp->nshootsent, mp->nshootrecv, mp->nshootfull);
+	}
+	for(i = 0; i < MACHMAX; i++){
+		if((mp = sys->machptr[i]) == nil || !mp->online || !mp->pcidok)
+			continue;
+		s = seprint(s, e, "mach%d: %lud pcid switches %lud kept gen %d\n",
+			i, mp->npcidalloc+mp->npcidhit, mp->npcidhit, mp->pcidgen);
+	}
+	return s;
 }
 
 static void
@@ -119,8 +196,12 @@ mmuptpfree(Proc* proc, int release)
 	 *	coalesce the clean and release functionality
 	 *	(it's either one or the other);
 	 *	0-based levels, not 1-based, for consistency;
-	 *	fix memset level for 2MiB pages;
 	 *	use a dedicated datastructure rather than Page?
+	 * PD and PDP pages may hold large page entries, not
+	 * just pointers to the tables below, so they are cleared
+	 * as well as PT pages. That clears all entries but those
+	 * in the PML4, which are the only ones cleared by index;
+	 * lower level pages do not record their parent table.
 	 */
 	for(l = 1; l < 4; l++){
 		last = &proc->mmuptp[l];
@@ -128,10 +209,11 @@ mmuptpfree(Proc* proc, int release)
 			continue;
 		for(page = *last; page != nil; page = page->next){
 			if(!release){
-				if(l == 1)
-					memset(UINT2PTR(page->va), 0, PTSZ);
-				pte = UINT2PTR(page->prev->va);
-				pte[page->n] = 0;
+				memset(UINT2PTR(page->va), 0, PTSZ);
+				if(l == 3){
+					pte = UINT2PTR(page->prev->va);
+					pte[page->n] = 0;
+				}
 			}
 			last = &page->next;
 		}
@@ -148,10 +230,13 @@ mmuswitch(void)
 {
 	PTE *pte;
 	Page *page;
+	int flush;
 
+	flush = 0;
 	if(up->newtlb){
 		mmuptpfree(up, 0);
 		up->newtlb = 0;
+		flush = 1;
 	}
 
 	if(m->pml4->n){
@@ -168,7 +253,7 @@ mmuswitch(void)
 	}
 
 	tssrsp0(STACKALIGN(PTR2UINT(up->kstack+KSTACK)));
-	cr3put(m->pml4->pa);
+	cr3put(m->pml4->pa|mmupcid(up, flush));
 }
 
 void
@@ -186,38 +271,86 @@ mmurelease(Proc* proc)
 		mmuptprelease(page);
 	}
 	proc->mmuptp[0] = nil;
+	proc->pcidgen = 0;
 
 	tssrsp0(STACKALIGN(m->stack+MACHSTKSZ));
 	cr3put(m->pml4->pa);
 }
 
+/*
+ * Move the table at pa, kept in p's list for level l, and the
+ * tables below it to p's free list, cleared.
+ * The TLB must not hold them.
+ */
+static void
+mmuptpput(Proc *p, uintmem pa, int l)
+{
+	Page **lp, *page;
+	PTE *pte;
+	int i;
+
+	for(lp = &p->mmuptp[l]; (page = *lp) != nil; lp = &page->next)
+		if(page->pa == pa)
+			break;
+	if(page == nil)
+		panic("mmuptpput: no table %#P level %d", pa, l);
+	*lp = page->next;
+	pte = UINT2PTR(page->va);
+	if(l > 1)
+		for(i = 0; i < PTSZ/sizeof(PTE); i++)
+			if((pte[i] & (PteP|PtePS)) == PteP)
+				mmuptpput(p, PTEADDR(pte[i]), l-1);
+	memset(pte, 0, PTSZ);
+	page->next = p->mmuptp[0];
+	p->mmuptp[0] = page;
+}
+
 static PTE*
 mmuptpget(uintptr va, int level)
 {
 	return (PTE*)KSEG1PTP(va, level);
 }
 
+/*
+ * Map va to pa using an entry at the given level:
+ * 0 for PGSZ pages, 1 for 2M pages, 2 for 1G pages.
+ * Existing tables are found by following the entries in the
+ * HW tables, so the cost does not depend on how many table pages
+ * the process has. Only PDP pages of a process other than up
+ * must be searched for, as the PML4 belongs to the mach; there
+ * are at most a few of them.
+ * A table replaced by a large page entry may be cached in the TLB
+ * for any address in the range; the TLB is flushed and the table
+ * (and those below it) go back to the process free list.
+ * The same flush is needed when a large page entry is replaced
+ * by a table.
+ */
 static void
-mmuput1(Proc *p, uintptr va, uintmem pa, uint pflags)
+mmuput1(Proc *p, uintptr va, uintmem pa, uint pflags, int level)
 {
 	Mpl pl;
 	int l, x;
-	PTE *pte, *ptp;
-	Page *page, *prev;
+	PTE *ptp;
+	Page *page;
+	uintmem old;
+	int flush;
 
-	pte = nil;
-	ptp = nil;
 	pl = splhi();
-	prev = m->pml4;
-	for(l = 3; l >= 0; l--){
+	flush = 0;
+	ptp = nil;
+	if(p == up)
+		ptp = UINT2PTR(m->pml4->va);
+	for(l = 3; l > level; l--){
 		x = PTLX(va, l);
-		if(p == up)
-			ptp = mmuptpget(va, l);
-		pte = &ptp[x];
-		for(page = p->mmuptp[l]; page != nil; page = page->next){
-			if(page->prev == prev && page->n == x)
-				break;
+		if(ptp != nil && (ptp[x] & (PteP|PtePS)) == PteP){
+			ptp = UINT2PTR(KADDR(PTEADDR(ptp[x])));
+			continue;
 		}
+		page = nil;
+		if(ptp == nil)
+			for(page = p->mmuptp[3]; page != nil; page = page->next)
+				if(page->n == x)
+					break;
 		if(page == nil){
 			if(p->mmuptp[0] == 0){
 				page = mmuptpalloc();
@@ -229,29 +362,64 @@ mmuput1(Proc *p, uintptr va, uintmem pa, uint pflags)
 			page->n = x;
 			page->next = p->mmuptp[l];
 			p->mmuptp[l] = page;
-			page->prev = prev;
-			if(p == up || l != 3)
-				*pte = PPN(page)|PteU|PteRW|PteP;
+			page->prev = nil;
+			if(l == 3)
+				page->prev = m->pml4;
+			if(ptp != nil){
+				/* a large page may be cached for the range */
+				if((ptp[x] & (PteP|PtePS)) == (PteP|PtePS))
+					flush = 1;
+				ptp[x] = PPN(page)|PteU|PteRW|PteP;
+			}
 			if(p == up && l == 3 && x >= m->pml4->n)
 				m->pml4->n = x+1;
 		}
-		if(p != up)
-			ptp = UINT2PTR(KADDR(page->pa));
-		prev = page;
+		ptp = UINT2PTR(page->va);
 	}
 
-	*pte = pa|pflags|PteU;
+	x = PTLX(va, level);
+	old = 0;
+	if(level > 0){
+		pflags |= PtePS;
+		if((ptp[x] & (PteP|PtePS)) == PteP)
+			old = PTEADDR(ptp[x]);
+	}
+	ptp[x] = pa|pflags|PteU;
 //if(pa & PteRW)
 //  *pte |= PteNX;
+	if(old != 0 || flush){
+		if(p == up)
+			cr3put(m->pml4->pa|mmupcid(up, 1));
+		else
+			p->pcidgen = 0;	/* flush when it runs again */
+		if(old != 0)
+			mmuptpput(p, old, level);
+	}
 	splx(pl);
 
-	if(p == up)
+	if(p == up && old == 0 && !flush)
 		invlpg(va);		/* only if old entry valid? */
 }
 
 /*
- * TODO: If the pg size is directly supported in HW,
- * for pgsz > PGSZ, use a single HW entry.
+ * MMU level using entries for pages of size 1<<pgszlg2
+ * or 0 if that size is not directly supported in HW.
+ */
+static int
+mmupglevel(uint pgszlg2)
+{
+	int l;
+
+	for(l = m->npgsz-1; l > 0; l--)
+		if(m->pgszlg2[l] == pgszlg2)
+			return l;
+	return 0;
+}
+
+/*
+ * If the pg size is directly supported in HW and the page
+ * is aligned, use a single HW entry. Otherwise use
+ * as many PGSZ entries as needed.
  */
 void
 mmuput(Proc *p, Page *pg, uint flags)
@@ -259,36 +427,115 @@ mmuput(Proc *p, Page *pg, uint flags)
 	uint pgsz, pflags;
 	uintmem pa;
 	uintptr va;
+	int l;
 
 	pgsz = (1<<pg->pgszlg2);
 	va = pg->va;
 	pa = PPN(pg);
 	pflags = (flags&(PGSZ-1));
+	l = mmupglevel(pg->pgszlg2);
+	if(l > 0 && ALIGNED(va, pgsz) && ALIGNED(pa, pgsz)){
+		mmuput1(p, va, pa, pflags, l);
+		return;
+	}
 	do{
-		mmuput1(p, va, pa, pflags);
+		mmuput1(p, va, pa, pflags, 0);
 		va += PGSZ;
 		pa += PGSZ;
 		pgsz -= PGSZ;
 	}while(pgsz > 0);
 }
 
+/*
+ * Clear the entries mapping [va, top) for up and
+ * invalidate them in the TLB.
+ * Large page entries partially in the range are cleared whole.
+ */
+static void
+mmuflushrange(uintptr va, uintptr top)
+{
+	uintptr next;
+	PTE *pte;
+	int l;
+
+	while(va < top){
+		next = va + PGSZ;
+		if((l = mmuwalk(va, 0, &pte, nil)) != -1){
+			if(l > 0 && (*pte == 0 || (*pte & PtePS)))
+				next = (va & ~(PGLSZ(l)-1)) + PGLSZ(l);
+			if(*pte != 0){
+				*pte = 0;
+				invlpg(va);
+			}
+		}
+		if(next < va)
+			break;
+		va = next;
+	}
+}
+
 void
 mmuflushpg(Page *pg)
 {
-	uintptr va;
-	usize pgsz;
-	PTE *pte;
+	mmuflushrange(pg->va, pg->va + (1<<pg->pgszlg2));
+}
 
-	pgsz = 1<<pg->pgszlg2;
-	va = pg->va;
-	do{
-		if(mmuwalk(va, 0, &pte, nil) != -1 && *pte != 0){
-			*pte = 0;
-			invlpg(va);
+/*
+ * TLB shootdown.
+ * Ask mp, which is running a process using [va, top),
+ * to drop the translations for that range, using an IPI.
+ * Requests made while one is pending are merged.
+ * A request for this mach is handled right away.
+ * The receiver flushes the whole mmu state when the range
+ * is larger than Shootmax pages.
+ * The clock interrupt still honours mmuflush, in case
+ * the IPI is not seen (see portclock.c).
+ */
+enum
+{
+	Shootmax = 32,		/* pages; flush everything above this */
+};
+
+void
+mmushootdown(Mach *mp, uintptr va, uintptr top)
+{
+	ilock(&mp->shootlock);
+	if(mp->mmuflush){
+		if(va < mp->shootva)
+			mp->shootva = va;
+		if(top > mp->shoottop)
+			mp->shoottop = top;
+	}else{
+		mp->shootva = va;
+		mp->shoottop = top;
+	}
+	mp->mmuflush = 1;
+	iunlock(&mp->shootlock);
+	if(mp == m){
+		/* no need to wait for the clock */
+		mmushootintr(nil, nil);
+		return;
+	}
+	m->nshootsent++;
+	apicipi(mp->apicno);
+}
+
+void
+mmushootintr(Ureg*, void*)
+{
+	ilock(&m->shootlock);
+	if(m->mmuflush){
+		m->nshootrecv++;
+		if(up != nil){
+			if(m->shoottop - m->shootva > Shootmax*PGSZ){
+				m->nshootfull++;
+				mmuflush();
+			}else
+				mmuflushrange(m->shootva, m->shoottop);
 		}
-		va += PGSZ;
-		pgsz -= PGSZ;
-	}while(pgsz > 0);
+		m->mmuflush = 0;
+	}
+	iunlock(&m->shootlock);
 }
 
 static PTE
@@ -615,6 +862,7 @@ pte[PTLX(KSEG1PML4, 3)] = m->pml4->pa|PteRW|PteP;
 		r |= Nxe;
 		wrmsr(Efer, r);
 		cr3put(m->pml4->pa);
+		mmupcidinit();
 		print("mach%d: %#p pml4 %#p\n", m->machno, m, m->pml4);
 		return;
 	}
@@ -681,6 +929,7 @@ pte[PTLX(KSEG1PML4, 3)] = m->pml4->pa|PteRW|PteP;
 	pml4 = cr3get();
 	sys->pml4[PTLX(KSEG1PML4, 3)] = pml4|PteRW|PteP;
 	cr3put(m->pml4->pa);
+	mmupcidinit();
 
 	if((l = mmuwalk(KZERO, 3, &pte, nil)) >= 0)
 		print("l %d %#p %llux\n", l, pte, *pte);
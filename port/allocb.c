@@ -46,6 +46,15 @@ Nalloc balloc =
 	baalloc,
 };
 
+/* headers for BEXT blocks */
+Nalloc xballoc =
+{
+	"extblock",
+	sizeof(Block),
+	Selfnone,
+	0,
+};
+
 static Lock iaclk;
 static Iac iac[DEBUGALLOC+1];
 int debugialloc;
@@ -69,6 +78,7 @@ char*
 iallocsummary(char *s, char *e, void*)
 {
 	s = nasummary(s, e, &balloc);
+	s = nasummary(s, e, &xballoc);
 	return seprint(s, e, "%lud/%lud ialloc bytes\n", ialloc.bytes, ialloc.limit);
 }
 
@@ -137,6 +147,8 @@ _allocb(int size, uintptr tag)
 	b->next = nil;
 	b->list = nil;
 	b->free = nil;
+	b->pg = nil;
+	b->aux = nil;
 	b->checksum = 0;
 
 	/* align start of writable data, leaving space below for added headers */
@@ -165,6 +177,77 @@ allocb(int size)
 	return b;
 }
 
+/*
+ * Block for len bytes at p, kept elsewhere.
+ * The data is not copied and it is read-only for the users of the block:
+ * there is no room to add headers or trailers (wp == lim), so padblock,
+ * pullupblock and friends copy into a new block when they need room.
+ * If pg is not nil the block holds a reference to it.
+ * When the block is freed, free (if not nil) is called and then the
+ * reference to pg (if any) is released.
+ */
+Block*
+extblock(uchar *p, int len, Page *pg, void (*free)(Block*), void *aux)
+{
+	Block *b;
+
+	b = nalloc(&xballoc);
+	b->base = p;
+	b->rp = p;
+	b->wp = p + len;
+	b->lim = b->wp;
+	b->flag = BEXT;
+	b->next = nil;
+	b->list = nil;
+	b->free = free;
+	b->aux = aux;
+	b->checksum = 0;
+	if(pg != nil)
+		incref(pg);
+	b->pg = pg;
+	return b;
+}
+
+/*
+ * Block for len bytes at off within pg, sharing the page.
+ */
+Block*
+pageblock(Page *pg, int off, int len)
+{
+	KMap *k;
+
+	if(off < 0 || len < 0 || off+len > (1<<pg->pgszlg2))
+		panic("pageblock: off %d len %d", off, len);
+	/*
+	 * pages stay mapped while referenced; kmap only
+	 * yields the address (kunmap is a no-op).
+	 */
+	k = kmap(pg);
+	return extblock((uchar*)VA(k) + off, len, pg, nil, nil);
+}
+
+static void
+freeextb(Block *b)
+{
+	void *dead = (void*)Bdead;
+	Page *pg;
+
+	if(b->free != nil)
+		b->free(b);
+	pg = b->pg;
+	b->rp = dead;
+	b->wp = dead;
+	b->next = dead;
+	b->lim = dead;
+	b->base = dead;
+	b->pg = nil;
+	b->free = nil;
+	b->aux = nil;
+	nfree(&xballoc, b);
+	if(pg != nil)
+		putpage(pg);
+}
+
 void
 ialloclimit(ulong limit)
 {
@@ -218,6 +301,11 @@ freeb(Block *b)
 	if(b == nil)
 		return;
 
+	if(b->flag & BEXT){
+		freeextb(b);
+		return;
+	}
+
 	/*
 	 * drivers which perform non cache coherent DMA manage their own buffer
 	 * pool of uncached buffers and provide their own free routine.
@@ -9,26 +9,38 @@
  * This is a cache for files not used as program binaries.
  * The cache in segment.c keeps text files cached.
  *
- * TODO: reclaim cache entries when low on memory. Now keeps NBYTES
- * cached no matter how low on memory we are. When this is done,
- * we can increase NBYTES to a large size and the the cache eat
- * unused memory.
+ * Cache entries are reclaimed by the page allocator when low on
+ * memory (see pgreclaim in page.c). Besides that, we keep at most
+ * maxbytes cached, which can be set with *cachebytes; zero means
+ * the cache may eat all unused memory.  Each file accounts for
+ * CSEGSZ bytes besides its pages.
  *
+ * Files are hashed by (dev, qid.path) in a table with a lock per
+ * bucket, doubled when there are more than two files per bucket.
+ * The cache Lock is for the lru and the read queue; if both are
+ * needed, the bucket is locked first.
  */
 
 typedef struct Mntcache Mntcache;
 typedef struct Frd Frd;
+typedef struct Chash Chash;
+typedef struct Ctab Ctab;
 
 enum
 {
-	FHASHSIZE = 101,
+	NHASH = 64,		/* initial nb. of hash buckets */
 	NBYTES = 64ull*MiB,	/* reclaim when cache has this size */
-	NFILES = 100,		/* max nb. of files cached */
+	CSEGSZ = 4*KiB,		/* bytes accounted per file, besides pages */
 	NRPROCS = 8,		/* max nb. of read procs */
 
 	CPGSHFT = UPGSHFT,	/* log2(page size used in cache segments) */
 	CPGSZ = 1<<CPGSHFT,	/* page size used */
-	NREAD = 2*CPGSZ,	/* read window size in bytes (32k) */
+	NWBBYTES = 64*MiB,	/* max. bytes in write-behind, for all files */
+	NREAD = 2*CPGSZ,	/* min. read window size in bytes (32k) */
+	MAXNREAD = 64*CPGSZ,	/* max. read window size in bytes (1m) */
+	MAXRA = 4*MiB,		/* max. read ahead for sequential reads */
+
+	Pgra = 2,		/* Page.n for pages read ahead and not used yet */
 };
 
 struct Frd
@@ -39,16 +51,35 @@ struct Frd
 	vlong	off;
 };
 
+struct Chash
+{
+	Lock;
+	Segment	*s;
+};
+
+struct Ctab
+{
+	Ctab	*old;		/* previous table; kept for lookups using it */
+	uint	n;		/* nb. of buckets, a power of 2 */
+	Chash	h[1];
+};
+
 struct Mntcache
 {
 	Lock;
-	Segment	*hash[FHASHSIZE];
+	Ctab	*tab;
+	QLock	growlk;			/* one grower at a time */
 	Segq;
-	uint	nseg;			/* used or cached files */
+	int	nseg;			/* used or cached files */
 	uvlong	nbytes;
+	uvlong	wbbytes;		/* bytes in write-behind */
 	QLock	reclaimlk;		/* one reclaimer at a time */
 	int	nrcalls;		/* nb of seg reclaim calls */
 	int	nreclaims;		/* nb of segs reclaimed */
+	ulong	nhits;			/* pages read from the cache */
+	ulong	nmisses;		/* reads waiting for the server */
+	ulong	nrapages;		/* pages read ahead */
+	ulong	nraused;		/* pages read ahead and then read */
 
 	int	nprocs;
 	Frd	*rfree;
@@ -58,8 +89,6 @@ struct Mntcache
 	Rendez	rr;
 };
 
-#define chash(mc)	(&cache.hash[(mc)%FHASHSIZE])
-
 /* Don't cache anything other than plain files, and
  * exclude exclusive open, append only, auth files and directories.
  */
@@ -69,18 +98,116 @@ extern int	mntabort(Mntrpc*);
 extern void	pagedin(Page*);
 extern Mntrpc*	mntrdwred(Mntrpc *r, long *np);
 extern Mntrpc*	mntrdwring(Mntrpc *prev, int type, Chan *c, void *buf, long n, vlong off);
+extern Mntrpc*	mntkreading(Mntrpc *prev, Chan *c, void *buf, long n, vlong off);
 extern void	mntfree(Mntrpc *r);
 
+static void	cattrinit(void);
+
 static Mntcache cache;
 static int nocache;
+static uvlong maxbytes = NBYTES;
+static long wbmax;	/* write-behind bytes per chan; 0: write-through */
 
 static char*
 cachesummary(char *s, char *e, void*)
 {
 	return seprint(s, e, "%ulld/%ulld cache bytes\n"
-		"%d/%d cache segs %d/%d reclaims %d procs\n",
-		cache.nbytes, NBYTES, cache.nseg, NFILES,
-		cache.nreclaims, cache.nrcalls, cache.nprocs);
+		"%d cache segs %ud buckets %d/%d reclaims %d procs\n"
+		"%ulld write-behind bytes\n"
+		"%lud/%lud cache hits/misses %lud/%lud read ahead used\n",
+		cache.nbytes, maxbytes, cache.nseg, cache.tab->n,
+		cache.nreclaims, cache.nrcalls, cache.nprocs,
+		cache.wbbytes, cache.nhits, cache.nmisses,
+		cache.nraused, cache.nrapages);
+}
+
+static void
+cadd(uvlong *p, vlong n)
+{
+	uvlong v;
+
+	do
+		v = *p;
+	while(!CASV(p, v, v+n));
+}
+
+static uint
+chashfn(Dev *d, uvlong path)
+{
+	uvlong h;
+
+	h = (path ^ PTR2UINT(d)) * 0x9E3779B97F4A7C15ULL;
+	return h>>32;
+}
+
+/*
+ * Lock and return the bucket for (d, path), retrying
+ * if the table is replaced meanwhile.
+ */
+static Chash*
+chashlock(Dev *d, uvlong path)
+{
+	Ctab *t;
+	Chash *h;
+
+	for(;;){
+		t = cache.tab;
+		h = &t->h[chashfn(d, path) & (t->n-1)];
+		lock(h);
+		if(t == cache.tab)
+			return h;
+		unlock(h);
+	}
+}
+
+static Ctab*
+ctaballoc(uint n)
+{
+	Ctab *t;
+
+	t = malloc(sizeof(Ctab) + (n-1)*sizeof(Chash));
+	if(t != nil)
+		t->n = n;
+	return t;
+}
+
+/*
+ * Double the hash table, holding all the buckets of the
+ * old one while moving the files.
+ */
+static void
+cgrow(void)
+{
+	Ctab *t, *nt;
+	Segment *s, *next;
+	Chash *h;
+	uint i;
+
+	if(!canqlock(&cache.growlk))
+		return;
+	t = cache.tab;
+	if(cache.nseg <= 2*t->n || (nt = ctaballoc(2*t->n)) == nil){
+		qunlock(&cache.growlk);
+		return;
+	}
+	nt->old = t;
+	for(i = 0; i < t->n; i++)
+		lock(&t->h[i]);
+	for(i = 0; i < t->n; i++){
+		for(s = t->h[i].s; s != nil; s = next){
+			next = s->hash;
+			h = &nt->h[chashfn(s->cdev, s->cqid.path) & (nt->n-1)];
+			s->hash = h->s;
+			h->s = s;
+		}
+		t->h[i].s = nil;
+	}
+	coherence();
+	cache.tab = nt;
+	for(i = 0; i < t->n; i++)
+		unlock(&t->h[i]);
+	qunlock(&cache.growlk);
+	DBG("cgrow %ud buckets\n", nt->n);
 }
 
 /*
@@ -90,7 +217,9 @@ cachesummary(char *s, char *e, void*)
 static Segment*
 clookup(Chan *c, int mkit)
 {
-	Segment *s, **h;
+	Segment *s;
+	Chash *h;
+	int n;
 
 	if(c->mc != nil)
 		return c->mc;
@@ -99,12 +228,12 @@ clookup(Chan *c, int mkit)
 		unlock(&c->mclock);
 		return c->mc;
 	}
-	lock(&cache);
-	h = chash(c->qid.path);
-	for(s = *h; s != nil; s = s->hash)
+	n = 0;
+	h = chashlock(c->dev, c->qid.path);
+	for(s = h->s; s != nil; s = s->hash)
 		if(c->qid.path == s->cqid.path && c->qid.type == s->cqid.type &&
 		   c->dev == s->cdev){
-			usedseg(&cache, s);
+			s->used = 1;
 			c->mc = s;
 			incref(s);
 			break;
@@ -121,13 +250,18 @@ clookup(Chan *c, int mkit)
 		s->cdev = c->dev;
 		s->clength = -1;
 		s->nbytes = 0;
+		s->hash = h->s;
+		h->s = s;
+		lock(&cache);
 		linkseg(&cache, s);
-		s->hash = *h;
-		*h = s;
-		cache.nseg++;
+		unlock(&cache);
+		n = ainc(&cache.nseg);
+		cadd(&cache.nbytes, CSEGSZ);
 	}
-	unlock(&cache);
+	unlock(h);
 	unlock(&c->mclock);
+	if(n > 2*cache.tab->n)
+		cgrow();
 	return s;
 }
 
@@ -201,6 +335,23 @@ ceof(Chan *c, vlong off)
 	return off;
 }
 
+/*
+ * The read window follows the iounit, so mounts with a
+ * large msize read more ahead per round trip.
+ */
+static long
+cwindow(Chan *c)
+{
+	long n;
+
+	n = ROUNDUP(c->iounit, CPGSZ);
+	if(n < NREAD)
+		n = NREAD;
+	if(n > MAXNREAD)
+		n = MAXNREAD;
+	return n;
+}
+
 static int
 mcread(Chan *c, Segment *s, vlong off, int wait)
 {
@@ -209,13 +360,13 @@ mcread(Chan *c, Segment *s, vlong off, int wait)
 	usize pgsz, nr;
 	long rlen, np;
 	Mntrpc *r0, *r, *rr;
-	Page **pg, *pgs[NREAD/CPGSZ], *new;
-	int i, nrpcs[NREAD/CPGSZ];
+	Page **pg, *pgs[MAXNREAD/CPGSZ], *new;
+	int i, nrpcs[MAXNREAD/CPGSZ];
 	KMap *k;
 	uchar *p;
 
 	qlock(&s->lk);
-	count = clen(s, NREAD, off);
+	count = clen(s, cwindow(c), off);
 	qunlock(&s->lk);
 	if(count == 0)
 		return 0;
@@ -235,9 +386,7 @@ mcread(Chan *c, Segment *s, vlong off, int wait)
 		count = s->nbytes;
 		cclear(s);
 		qunlock(&s->lk);
-		lock(&cache);
-		cache.nbytes -= count;
-		unlock(&cache);
+		cadd(&cache.nbytes, -count);
 		nexterror();
 	}
 	DBG("mcread pid %d %N %#llx\n", up->pid, c->path, off);
@@ -270,16 +419,14 @@ mcread(Chan *c, Segment *s, vlong off, int wait)
 		incref(new);
 		qlock(new);
 		qunlock(&s->lk);
-		lock(&cache);
-		cache.nbytes += pgsz;
-		unlock(&cache);
+		cadd(&cache.nbytes, pgsz);
 		k = kmap(*pg);
 		p = (uchar*)VA(k);
 		for(ptot = 0; ptot < pgsz; ptot += nr){
 			USED(&r0);
 			USED(&np);
 			nrpcs[np-1]++;
-			r = mntrdwring(r, Tread, c, p+ptot, pgsz-ptot, addr+ptot);
+			r = mntkreading(r, c, p+ptot, pgsz-ptot, addr+ptot);
 			nr = r->request.count;
 			if(r0 == nil)
 				r0 = r;
@@ -287,6 +434,8 @@ mcread(Chan *c, Segment *s, vlong off, int wait)
 		qlock(&s->lk);
 	}
 	qunlock(&s->lk);
+	if(!wait)
+		cache.nrapages += np;
 	eof = -1;
 	r = r0;
 	for(i = 0; i < np; i++){
@@ -301,7 +450,7 @@ mcread(Chan *c, Segment *s, vlong off, int wait)
 			r = rr;
 		}
 		if(*pg != nil){
-			(*pg)->n = 1;
+			(*pg)->n = wait? 1 : Pgra;
 			kunmap(*pg);
 			qunlock(*pg);
 			putpage(*pg);
@@ -440,51 +589,81 @@ cinit(void)
 {
 	char *s;
 
+	cache.tab = ctaballoc(NHASH);
+	if(cache.tab == nil)
+		panic("cinit: no memory");
 	addsummary(cachesummary, nil);
 	if((s=getconf("*nocache")) != nil)
 		nocache = atoi(s);
+	if((s=getconf("*cachebytes")) != nil)
+		maxbytes = strtoull(s, nil, 0);
+	if((s=getconf("*cachewb")) != nil)
+		wbmax = strtol(s, nil, 0);
+	cattrinit();
 }
 
+/*
+ * called with the bucket for s locked
+ */
 static void
-unhashseg(Segment *s)
+unhashseg(Chash *h, Segment *s)
 {
 	Segment **l;
 
-	for(l = chash(s->cqid.path); *l != nil; l = &(*l)->hash)
+	for(l = &h->s; *l != nil; l = &(*l)->hash)
 		if(*l == s)
 			break;
 	if(*l == nil)
 		panic("unhashseg: not found");
 	*l = s->hash;
 	s->hash = nil;
-	cache.nseg--;
-	cache.nbytes -= s->nbytes;
+	adec(&cache.nseg);
+	cadd(&cache.nbytes, -(s->nbytes+CSEGSZ));
 }
 
+/*
+ * Is s in the lru? (creclaim takes it out for a while)
+ * called with cache locked
+ */
 static int
+inlru(Segment *s)
+{
+	return s->lprev != nil || cache.hd == s;
+}
+
+int
 creclaim(void)
 {
 	Segment *s;
+	Chash *h;
 
 	cache.nrcalls++;
 	/* Somebody is already segreclaiming */
 	if(!canqlock(&cache.reclaimlk))
 		return -1;
 
-	iprint("creclaim\n");
+	DBG("creclaim\n");
 	lock(&cache);
 	s = segvictim(&cache);
+	unlock(&cache);
 	if(s == nil){
+		qunlock(&cache.reclaimlk);
+		DBG("cache: nothing to reclaim\n");
+		return -1;
+	}
+	h = chashlock(s->cdev, s->cqid.path);
+	if(s->ref != 1){
+		/* found by clookup meanwhile */
+		lock(&cache);
+		linkseg(&cache, s);
 		unlock(&cache);
+		unlock(h);
 		qunlock(&cache.reclaimlk);
-		print("cache: nothing to reclaim\n");
 		return -1;
 	}
 	cache.nreclaims++;
-	unhashseg(s);
-	unlock(&cache);
-	if(s->ref != 1)
-		panic("creclaim: ref");
+	unhashseg(h, s);
+	unlock(h);
 	DBG("creclaim pid %d %N\n", up->pid, s->cpath);
 	putseg(s);
 	qunlock(&cache.reclaimlk);
@@ -498,9 +677,7 @@ copen(Chan *c)
 		c->flag &= ~CCACHE;
 		return;
 	}
-	if(cache.nseg > NFILES)
-		creclaim();
-	while(cache.nbytes >= NBYTES && creclaim()==0)
+	while(maxbytes != 0 && cache.nbytes >= maxbytes && creclaim()==0)
 		;
 
 	DBG("copen %N\n", c->path);
@@ -513,6 +690,7 @@ cremove(Chan *c)
 {
 	Segment *mc;
 	usize count;
+	Chash *h;
 
 	if(!cacheable(c)){
 		c->flag &= ~CCACHE;
@@ -525,19 +703,69 @@ cremove(Chan *c)
 		count = mc->nbytes;
 		cclear(mc);
 		qunlock(&mc->lk);
+		cadd(&cache.nbytes, -count);
+		h = chashlock(mc->cdev, mc->cqid.path);
 		lock(&cache);
-		cache.nbytes -= count;
-		if(mc->ref == 2){
+		if(mc->ref == 2 && inlru(mc)){
 			/* unused: 1 for lru; 1 for c */
 			unlinkseg(&cache, mc);
-			unhashseg(mc);
+			unlock(&cache);
+			unhashseg(h, mc);
 			if(decref(mc) != 1)
 				panic("cremove ref");
-		}
-		unlock(&cache);
+		}else
+			unlock(&cache);
+		unlock(h);
 	}
 }
 
+/*
+ * Sequential reads double the read ahead window of c, up to MAXRA,
+ * or less when the cache is more than half its maximum size.
+ * Others make it collapse.
+ */
+static void
+cseq(Chan *c, vlong off, long len)
+{
+	if(off == c->rdoff){
+		if(c->rawin == 0)
+			c->rawin = cwindow(c);
+		else if(c->rawin < MAXRA)
+			c->rawin *= 2;
+		if(c->rawin > MAXRA)
+			c->rawin = MAXRA;
+		if(maxbytes != 0 && cache.nbytes+c->rawin > maxbytes/2)
+			c->rawin = cwindow(c);
+	}else{
+		c->rawin = 0;
+		c->raend = 0;
+	}
+	c->rdoff = off+len;
+}
+
+/*
+ * Queue reads for the window past end not queued yet.
+ */
+static void
+creadahead(Chan *c, vlong end)
+{
+	vlong off, eof;
+	long w;
+
+	w = cwindow(c);
+	off = c->raend;
+	if(off < end)
+		off = ROUNDDN(end, CPGSZ);
+	eof = c->mc->clength;
+	end += c->rawin;
+	if(eof >= 0 && end > eof)
+		end = eof;
+	for(; off < end; off += w)
+		creadq(c, off);
+	if(off > c->raend)
+		c->raend = off;
+}
+
 long
 cread(Chan *c, uchar *buf, long len, vlong off)
 {
@@ -554,6 +782,7 @@ cread(Chan *c, uchar *buf, long len, vlong off)
 		return -1;
 	}
 	DBG("cread pid %d %N %#lx %#llx\n", up->pid, c->path, len, off);
+	cseq(c, off, len);
 again:
 	mc = cseg(c);
 	if(mc->cpath == nil && c->path != nil){
@@ -572,10 +801,16 @@ again:
 				/* got some; done but read more ahead */
 				DBG("cread pid %d %N %#lx %#llx -> %#lx\n",
 					up->pid, c->path, len, off, tot);
-				creadq(c, addr);
+				if(c->rawin == 0)
+					creadq(c, addr);
+				else
+					creadahead(c, addr);
+				c->rdoff = off+tot;
 				return tot;
 			}
 			/* nothing: read it now and try again */
+			cflushed(c);
+			cache.nmisses++;
 			mcread(c, mc, addr, 1);
 			goto again;
 		}
@@ -589,6 +824,11 @@ again:
 			pagedin(pg);
 			qlock(&mc->lk);
 		}
+		if(pg->n == Pgra){
+			pg->n = 1;
+			cache.nraused++;
+		}
+		cache.nhits++;
 		o = off+tot - addr;
 		k = kmap(pg);
 		p = UINT2PTR(VA(k));
@@ -601,17 +841,236 @@ again:
 		poperror();
 	}
 	qunlock(&mc->lk);
+	if(c->rawin != 0)
+		creadahead(c, off+tot);
 	DBG("cread pid %d %N %#llx -> %#lx\n", up->pid, c->path, off, tot);
 	return tot;
 }
 
+static void
+cinval(Chan *c)
+{
+	Segment *mc;
+	usize count;
+
+	mc = cseg(c);
+	count = mc->nbytes;
+	cclear(mc);
+	qunlock(&mc->lk);
+	cadd(&cache.nbytes, -count);
+}
+
+/*
+ * Update the cached pages for data written at off.
+ * Pages still being read are dropped, for they might
+ * bring older data; so is everything if the write leaves
+ * a hole past the cached end of file.
+ */
+static void
+cupdate(Chan *c, uchar *buf, long len, vlong off)
+{
+	Segment *mc;
+	uintptr addr;
+	Page **pp, *pg;
+	usize pgsz, dropped;
+	long tot, o, nr;
+	KMap *k;
+	uchar *p;
+
+	mc = cseg(c);
+	if(mc->clength >= 0 && off > mc->clength){
+		qunlock(&mc->lk);
+		cinval(c);
+		return;
+	}
+	pgsz = (1<<mc->pgszlg2);
+	dropped = 0;
+	for(tot = 0; tot < len; tot += nr){
+		addr = ROUNDDN(off+tot, pgsz);
+		o = off+tot - addr;
+		nr = pgsz - o;
+		if(tot+nr > len)
+			nr = len-tot;
+		pp = segwalk(mc, addr, 0);
+		if(pp == nil || (pg = *pp) == nil)
+			continue;
+		if(pg->n == 0){
+			*pp = nil;
+			putpage(pg);
+			mc->nbytes -= pgsz;
+			dropped += pgsz;
+			continue;
+		}
+		k = kmap(pg);
+		p = UINT2PTR(VA(k));
+		memmove(p+o, buf+tot, nr);
+		kunmap(k);
+	}
+	if(mc->clength >= 0 && off+len > mc->clength)
+		mc->clength = off+len;
+	qunlock(&mc->lk);
+	if(dropped > 0)
+		cadd(&cache.nbytes, -dropped);
+}
+
+/*
+ * Keep the data read from offset 0 right after opening c,
+ * as asked for count bytes (see devlater.c).
+ * Only whole pages are kept, but for the last one when n < count.
+ */
+void
+cprefetched(Chan *c, uchar *buf, long n, long count)
+{
+	Segment *mc;
+	uintptr addr;
+	Page **pp, *pg;
+	usize pgsz, added;
+	long nr;
+	KMap *k;
+	uchar *p;
+
+	if(!cacheable(c) || c->mc == nil)
+		return;
+	mc = cseg(c);
+	pgsz = (1<<mc->pgszlg2);
+	added = 0;
+	for(addr = 0; addr < n; addr += pgsz){
+		nr = n - addr;
+		if(nr > pgsz)
+			nr = pgsz;
+		if(nr < pgsz && n == count)
+			break;
+		pp = segwalk(mc, addr, 1);
+		if(*pp != nil)
+			continue;
+		pg = newpage(pgsz, mc->color, 0, 0);
+		k = kmap(pg);
+		p = UINT2PTR(VA(k));
+		memmove(p, buf+addr, nr);
+		kunmap(k);
+		pg->n = 1;
+		*pp = pg;
+		mc->nbytes += pgsz;
+		added += pgsz;
+	}
+	if(n < count && (mc->clength < 0 || mc->clength > n))
+		mc->clength = n;
+	qunlock(&mc->lk);
+	cadd(&cache.nbytes, added);
+	DBG("cprefetched %N %ld\n", c->path, n);
+}
+
+/*
+ * Wait for the write-behind rpcs of c and release them,
+ * even if interrupted.  Raise the first error.
+ * Called with c->wblk held.
+ */
+static void
+cwbwait(Chan *c)
+{
+	Mntrpc *r, *r0;
+	char err[ERRMAX];
+	long nw, n;
+
+	r0 = c->wb;
+	n = c->nwb;
+	c->wb = c->wbtl = nil;
+	c->nwb = 0;
+	if(r0 == nil)
+		return;
+	err[0] = 0;
+	for(r = r0; r != nil; ){
+		if(waserror()){
+			if(r->done){
+				if(err[0] == 0)
+					kstrcpy(err, up->errstr, ERRMAX);
+				r = r->tagnext;
+			}
+			continue;
+		}
+		mntrdwred(r, &nw);
+		poperror();
+		if(nw != r->request.count && err[0] == 0)
+			kstrcpy(err, "short write", ERRMAX);
+		r = r->tagnext;
+	}
+	mntfree(r0);
+	cadd(&cache.wbbytes, -n);
+	if(err[0] != 0){
+		cinval(c);
+		error(err);
+	}
+}
+
+/*
+ * Account for len more bytes in write-behind,
+ * unless that would exceed NWBBYTES in total.
+ */
+static int
+cwbreserve(long len)
+{
+	uvlong v;
+
+	do{
+		v = cache.wbbytes;
+		if(v+len > NWBBYTES)
+			return 0;
+	}while(!CASV(&cache.wbbytes, v, v+len));
+	return 1;
+}
+
+/*
+ * Write-behind: send the Twrites and return;
+ * replies are collected by later writes when c has more
+ * than wbmax bytes pending, or by cflushed (fdflush, close).
+ * The caller has reserved len bytes with cwbreserve.
+ */
+static long
+cwriteq(Chan *c, uchar *buf, long len, vlong off)
+{
+	Mntrpc *r, *r0;
+	long tot, nw;
+
+	qlock(&c->wblk);
+	if(waserror()){
+		qunlock(&c->wblk);
+		cadd(&cache.wbbytes, -len);
+		nexterror();
+	}
+	if(c->nwb+len > wbmax)
+		cwbwait(c);
+	r0 = nil;
+	r = nil;
+	if(waserror()){
+		mntabort(r0);
+		cinval(c);
+		nexterror();
+	}
+	for(tot = 0; tot < len; tot += nw){
+		USED(&r0);
+		r = mntrdwring(r, Twrite, c, buf+tot, len-tot, off+tot);
+		nw = r->request.count;
+		if(r0 == nil)
+			r0 = r;
+	}
+	poperror();
+	if(c->wbtl == nil)
+		c->wb = r0;
+	else
+		c->wbtl->tagnext = r0;
+	c->wbtl = r;
+	c->nwb += len;
+	poperror();
+	cupdate(c, buf, len, off);
+	qunlock(&c->wblk);
+	return len;
+}
+
 long
 cwrite(Chan *c, uchar *buf, long len, vlong off)
 {
-	Segment *mc;
 	long tot, nw;
 	Mntrpc *r, *r0;
-	usize count;
 
 	if(!cacheable(c)){
 		c->flag &= ~CCACHE;
@@ -619,21 +1078,15 @@ cwrite(Chan *c, uchar *buf, long len, vlong off)
 	}
 	DBG("cwrite pid %d %N %#lx %#llx\n", up->pid, c->path, len, off);
 
-	mc = cseg(c);
-	/*
-	 * TODO: could invalidate only the range written, or
-	 * update the cache like the old cache code did.
-	 */
-	count = mc->nbytes;
-	cclear(mc);
-	qunlock(&mc->lk);
-	lock(&cache);
-	cache.nbytes -= count;
-	unlock(&cache);
+	/* write through when there is too much write-behind data */
+	if(len > 0 && len <= wbmax && cwbreserve(len))
+		return cwriteq(c, buf, len, off);
+	cflushed(c);
 	r0 = nil;
 	r = nil;
 	if(waserror()){
 		mntabort(r0);
+		cinval(c);
 		nexterror();
 	}
 	for(tot = 0; tot < len; tot += nw){
@@ -649,10 +1102,521 @@ cwrite(Chan *c, uchar *buf, long len, vlong off)
 		r = mntrdwred(r, &nw);
 	poperror();
 	mntfree(r0);
+	cupdate(c, buf, tot, off);
 	return tot;
 }
 
+/*
+ * Wait for write-behind data written through c.
+ */
 void
-cflushed(Chan*)
+cflushed(Chan *c)
 {
+	if(c->wb == nil)
+		return;
+	qlock(&c->wblk);
+	if(waserror()){
+		qunlock(&c->wblk);
+		nexterror();
+	}
+	cwbwait(c);
+	poperror();
+	qunlock(&c->wblk);
+}
+
+/*
+ * Attribute cache for 9P2000.ix mounts.
+ * Dir entries from stats made by devlater are kept by
+ * (mount, qid.path of the walk origin, names walked),
+ * so that a stat of a known name takes no rpcs at all.
+ * Entries last for attrttl ms (*attrttl; 0 disables them),
+ * and are dropped when a walk or open sees a new qid.vers
+ * for their file, and on local wstat, remove, create,
+ * and clunk of files open for writing.
+ */
+
+typedef struct Attr Attr;
+typedef struct Attrcache Attrcache;
+typedef struct Neg Neg;
+typedef struct Negcache Negcache;
+
+enum
+{
+	NATTR = 4096,		/* max nb. of entries */
+	NNEG = 1024,		/* max nb. of negative entries */
+	AHASH = 256,
+	ATTRTTL = 1000,		/* ms */
+};
+
+struct Attr
+{
+	Attr	*hash;		/* by name */
+	Attr	*qhash;		/* by qid.path */
+	Attr	*next;		/* in fifo for eviction */
+	Attr	*prev;
+	uint	mntid;
+	uint	h;		/* bucket in attrs.hash */
+	uvlong	from;		/* qid.path for the walk origin */
+	char	*name;		/* names walked, '/' separated */
+	Qid	qid;
+	ulong	when;		/* ticks */
+	int	n;
+	uchar	*d;
+};
+
+struct Attrcache
+{
+	Lock;
+	Attr	*hash[AHASH];
+	Attr	*qhash[AHASH];
+	Attr	*hd;
+	Attr	*tl;
+	int	n;
+	ulong	nhits;
+	ulong	nmisses;
+	ulong	ninval;
+};
+
+/*
+ * Names known not to exist in a directory, as found by
+ * failed walks. Valid while the directory keeps the qid.vers
+ * and for attrttl ms; dropped when the name is created
+ * through the same mount.
+ */
+struct Neg
+{
+	Neg	*hash;
+	Neg	*next;		/* in fifo for eviction */
+	Neg	*prev;
+	uint	mntid;
+	uint	h;		/* bucket in negs.hash */
+	Qid	dir;
+	ulong	when;		/* ticks */
+	char	name[1];
+};
+
+struct Negcache
+{
+	Lock;
+	Neg	*hash[AHASH];
+	Neg	*hd;
+	Neg	*tl;
+	int	n;
+	ulong	nhits;
+	ulong	nmisses;
+};
+
+static Attrcache attrs;
+static Negcache negs;
+static ulong attrttl = ATTRTTL;
+
+static char*
+attrsummary(char *s, char *e, void*)
+{
+	return seprint(s, e, "%d/%d attrs %lud/%lud hits/misses %lud invals\n",
+		attrs.n, NATTR, attrs.nhits, attrs.nmisses, attrs.ninval);
+}
+
+static char*
+negsummary(char *s, char *e, void*)
+{
+	return seprint(s, e, "%d/%d negs %lud/%lud hits/misses\n",
+		negs.n, NNEG, negs.nhits, negs.nmisses);
+}
+
+static void
+cattrinit(void)
+{
+	char *s;
+
+	if((s=getconf("*attrttl")) != nil)
+		attrttl = strtoul(s, nil, 0);
+	addsummary(attrsummary, nil);
+	addsummary(negsummary, nil);
+}
+
+/*
+ * Mount id for the λ chan c, if its attributes may be cached.
+ */
+static uint
+amntid(Chan *c)
+{
+	Chan *lc;
+
+	lc = c->lchan;
+	if(attrttl == 0 || nocache || lc == nil || (c->flag&CCACHE) == 0)
+		return 0;
+	if(lc->mchan == nil || lc->mchan->mux == nil)
+		return 0;
+	return lc->mchan->mux->id;
+}
+
+static uint
+ahashname(uint id, uvlong from, Path *p)
+{
+	uint h;
+	int i;
+	char *s;
+
+	h = id*31 + (uint)from;
+	for(i = p->nres; i < p->nels; i++){
+		for(s = p->els[i]; *s != 0; s++)
+			h = h*31 + *s;
+		h = h*31 + '/';
+	}
+	return h%AHASH;
+}
+
+static int
+anameeq(Attr *a, Path *p)
+{
+	char *s;
+	int i, n;
+
+	s = a->name;
+	for(i = p->nres; i < p->nels; i++){
+		if(i > p->nres && *s++ != '/')
+			return 0;
+		n = strlen(p->els[i]);
+		if(strncmp(s, p->els[i], n) != 0)
+			return 0;
+		s += n;
+	}
+	return *s == 0;
+}
+
+/*
+ * called with attrs locked
+ */
+static Attr*
+alookup(uint id, uvlong from, Path *p)
+{
+	Attr *a;
+
+	for(a = attrs.hash[ahashname(id, from, p)]; a != nil; a = a->hash)
+		if(a->mntid == id && a->from == from && anameeq(a, p))
+			return a;
+	return nil;
+}
+
+/*
+ * called with attrs locked
+ */
+static void
+adrop(Attr *a)
+{
+	Attr **l;
+
+	for(l = &attrs.hash[a->h]; *l != a; l = &(*l)->hash)
+		;
+	*l = a->hash;
+	for(l = &attrs.qhash[a->qid.path%AHASH]; *l != a; l = &(*l)->qhash)
+		;
+	*l = a->qhash;
+	if(a->prev != nil)
+		a->prev->next = a->next;
+	else
+		attrs.hd = a->next;
+	if(a->next != nil)
+		a->next->prev = a->prev;
+	else
+		attrs.tl = a->prev;
+	attrs.n--;
+	free(a);
+}
+
+/*
+ * Copy the cached Dir for the λ chan c into dp, if any.
+ * Returns 0 when not cached.
+ */
+long
+cattr(Chan *c, uchar *dp, long n)
+{
+	Attr *a;
+	uint id;
+	long nd;
+
+	id = amntid(c);
+	if(id == 0)
+		return 0;
+	nd = 0;
+	lock(&attrs);
+	a = alookup(id, c->lchan->qid.path, c->path);
+	if(a != nil && sys->ticks - a->when > ms2tk(attrttl)){
+		adrop(a);
+		a = nil;
+	}
+	if(a != nil && a->n <= n){
+		memmove(dp, a->d, a->n);
+		nd = a->n;
+		attrs.nhits++;
+	}else
+		attrs.nmisses++;
+	unlock(&attrs);
+	return nd;
+}
+
+/*
+ * Keep the Dir obtained by stating the λ chan c.
+ */
+void
+cattrput(Chan *c, uchar *dp, long n)
+{
+	Attr *a, *old;
+	uint id;
+	uvlong from;
+	Path *p;
+	int i, len;
+	char *s;
+
+	id = amntid(c);
+	if(id == 0 || n <= BIT16SZ)
+		return;
+	p = c->path;
+	from = c->lchan->qid.path;
+	len = 0;
+	for(i = p->nres; i < p->nels; i++)
+		len += strlen(p->els[i]) + 1;
+	a = malloc(sizeof(Attr) + len + 1 + n);
+	if(a == nil)
+		return;
+	a->mntid = id;
+	a->from = from;
+	a->h = ahashname(id, from, p);
+	a->name = (char*)&a[1];
+	s = a->name;
+	for(i = p->nres; i < p->nels; i++){
+		if(i > p->nres)
+			*s++ = '/';
+		strcpy(s, p->els[i]);
+		s += strlen(s);
+	}
+	*s = 0;
+	a->d = (uchar*)s + 1;
+	a->n = n;
+	memmove(a->d, dp, n);
+	/* qid in the Dir: size[2] type[2] dev[4] qid[13] */
+	a->qid.type = dp[8];
+	a->qid.vers = GBIT32(dp+9);
+	a->qid.path = GBIT64(dp+13);
+	a->when = sys->ticks;
+
+	lock(&attrs);
+	if((old = alookup(id, from, p)) != nil)
+		adrop(old);
+	if(attrs.n >= NATTR)
+		adrop(attrs.hd);
+	a->hash = attrs.hash[a->h];
+	attrs.hash[a->h] = a;
+	a->qhash = attrs.qhash[a->qid.path%AHASH];
+	attrs.qhash[a->qid.path%AHASH] = a;
+	a->next = nil;
+	a->prev = attrs.tl;
+	if(attrs.tl != nil)
+		attrs.tl->next = a;
+	else
+		attrs.hd = a;
+	attrs.tl = a;
+	attrs.n++;
+	unlock(&attrs);
+}
+
+/*
+ * Drop the attributes cached for q in the mount of c,
+ * or just those out of date if anyvers is not set.
+ */
+static void
+aqidrm(Chan *c, Qid q, int anyvers)
+{
+	Attr *a, *next;
+	uint id;
+
+	if(attrs.n == 0 || c->mchan == nil || c->mchan->mux == nil)
+		return;
+	id = c->mchan->mux->id;
+	lock(&attrs);
+	for(a = attrs.qhash[q.path%AHASH]; a != nil; a = next){
+		next = a->qhash;
+		if(a->mntid == id && a->qid.path == q.path &&
+		   (anyvers || a->qid.vers != q.vers)){
+			adrop(a);
+			attrs.ninval++;
+		}
+	}
+	unlock(&attrs);
+}
+
+/*
+ * The server said c's file has qid q.
+ */
+void
+cattrqid(Chan *c, Qid q)
+{
+	aqidrm(c, q, 0);
+}
+
+/*
+ * c's file with qid q has been changed locally.
+ */
+void
+cattrinval(Chan *c, Qid q)
+{
+	aqidrm(c, q, 1);
+}
+
+/*
+ * Mount id for the walked chan c, if walks from it
+ * may use negative entries.
+ */
+static uint
+nmntid(Chan *c)
+{
+	if(attrttl == 0 || nocache || (c->flag&CCACHE) == 0)
+		return 0;
+	if(c->mchan == nil || c->mchan->mux == nil)
+		return 0;
+	return c->mchan->mux->id;
+}
+
+static uint
+nhashname(uint id, char *name)
+{
+	uint h;
+
+	h = id;
+	for(; *name != 0; name++)
+		h = h*31 + *name;
+	return h%AHASH;
+}
+
+/*
+ * called with negs locked
+ */
+static void
+ndrop(Neg *n)
+{
+	Neg **l;
+
+	for(l = &negs.hash[n->h]; *l != n; l = &(*l)->hash)
+		;
+	*l = n->hash;
+	if(n->prev != nil)
+		n->prev->next = n->next;
+	else
+		negs.hd = n->next;
+	if(n->next != nil)
+		n->next->prev = n->prev;
+	else
+		negs.tl = n->prev;
+	negs.n--;
+	free(n);
+}
+
+/*
+ * called with negs locked
+ */
+static Neg*
+nlookup(uint id, uint h, Qid dir, char *name)
+{
+	Neg *n;
+
+	for(n = negs.hash[h]; n != nil; n = n->hash)
+		if(n->mntid == id && n->dir.path == dir.path && strcmp(n->name, name) == 0)
+			return n;
+	return nil;
+}
+
+/*
+ * Is name known not to exist in the directory for c?
+ */
+int
+cnegwalk(Chan *c, char *name)
+{
+	Neg *n;
+	uint id;
+	int found;
+
+	id = nmntid(c);
+	if(id == 0 || negs.n == 0)
+		return 0;
+	found = 0;
+	lock(&negs);
+	n = nlookup(id, nhashname(id, name), c->qid, name);
+	if(n != nil){
+		if(n->dir.vers != c->qid.vers || sys->ticks - n->when > ms2tk(attrttl))
+			ndrop(n);
+		else
+			found = 1;
+	}
+	if(found)
+		negs.nhits++;
+	else
+		negs.nmisses++;
+	unlock(&negs);
+	return found;
+}
+
+/*
+ * A walk from c found no name in the directory with qid dir.
+ */
+void
+cnegput(Chan *c, Qid dir, char *name)
+{
+	Neg *n, *old;
+	uint id;
+
+	id = nmntid(c);
+	if(id == 0)
+		return;
+	n = malloc(sizeof(Neg) + strlen(name));
+	if(n == nil)
+		return;
+	n->mntid = id;
+	n->h = nhashname(id, name);
+	n->dir = dir;
+	n->when = sys->ticks;
+	strcpy(n->name, name);
+
+	lock(&negs);
+	if((old = nlookup(id, n->h, dir, name)) != nil)
+		ndrop(old);
+	if(negs.n >= NNEG)
+		ndrop(negs.hd);
+	n->hash = negs.hash[n->h];
+	negs.hash[n->h] = n;
+	n->next = nil;
+	n->prev = negs.tl;
+	if(negs.tl != nil)
+		negs.tl->next = n;
+	else
+		negs.hd = n;
+	negs.tl = n;
+	negs.n++;
+	unlock(&negs);
+}
+
+/*
+ * name has been created through c's mount, in any directory;
+ * a nil name drops all the entries for the mount.
+ */
+void
+cneginval(Chan *c, char *name)
+{
+	Neg *n, *next;
+	uint id;
+
+	if(negs.n == 0 || c->mchan == nil || c->mchan->mux == nil)
+		return;
+	id = c->mchan->mux->id;
+	lock(&negs);
+	if(name != nil)
+		n = negs.hash[nhashname(id, name)];
+	else
+		n = negs.hd;
+	for(; n != nil; n = next){
+		next = name != nil ? n->hash : n->next;
+		if(n->mntid == id && (name == nil || strcmp(n->name, name) == 0))
+			ndrop(n);
+	}
+	unlock(&negs);
 }
@@ -682,6 +682,7 @@ enum{
 	Qdrivers,
 	Qkmesg,
 	Qkprint,
+	Qmntstats,
 	Qhostdomain,
 	Qhostowner,
 	Qnull,
@@ -689,6 +690,7 @@ enum{
 	Qpgrpid,
 	Qpid,
 	Qppid,
+	Qqueues,
 	Qrandom,
 	Qreboot,
 	Qalloc,
@@ -716,11 +718,13 @@ static Dirtab consdir[]={
 	"hostowner",	{Qhostowner},	0,		0664,
 	"kmesg",	{Qkmesg},	0,		0440,
 	"kprint",	{Qkprint, 0, QTEXCL},	0,	DMEXCL|0440,
+	"mntstats",	{Qmntstats},	0,		0444,
 	"null",		{Qnull},	0,		0666,
 	"osversion",	{Qosversion},	0,		0444,
 	"pgrpid",	{Qpgrpid},	NUMSIZE,	0444,
 	"pid",		{Qpid},		NUMSIZE,	0444,
 	"ppid",		{Qppid},	NUMSIZE,	0444,
+	"queues",	{Qqueues},	0,		0444,
 	"random",	{Qrandom},	0,		0444,
 	"reboot",	{Qreboot},	0,		0664,
 	"alloc",		{Qalloc},	0,		0664,
@@ -875,6 +879,14 @@ consread(Chan *c, void *buf, long n, vlong off)
 		free(bp);
 		return n;
 
+	case Qqueues:
+		/* see qio.c */
+		return qstatsread(buf, n, offset);
+
+	case Qmntstats:
+		/* see devmnt.c */
+		return mntstatsread(buf, n, offset);
+
 	case Qcons:
 		qlock(&kbd);
 		if(waserror()) {
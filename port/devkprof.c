@@ -27,11 +27,15 @@ enum{
 	Kprofdirqid,
 	Kprofdataqid,
 	Kprofctlqid,
+	Kprofheapqid,
+	Kprofheapctlqid,
 };
 Dirtab kproftab[]={
 	".",		{Kprofdirqid, 0, QTDIR},0,	DMDIR|0550,
 	"kpdata",	{Kprofdataqid},		0,	0600,
 	"kpctl",	{Kprofctlqid},		0,	0600,
+	"kpheap",	{Kprofheapqid},		0,	0400,
+	"kpheapctl",	{Kprofheapctlqid},	0,	0600,
 };
 
 static void
@@ -147,6 +151,10 @@ kprofread(Chan *c, void *va, long n, vlong off)
 		}
 		break;
 
+	case Kprofheapqid:
+		/* see qmalloc.c */
+		return heapprofread(va, n, off);
+
 	default:
 		n = 0;
 		break;
@@ -166,6 +174,15 @@ kprofwrite(Chan *c, void *a, long n, vlong)
 			kprof.time = 1;
 		else if(strncmp(a, "stop", 4) == 0)
 			kprof.time = 0;
+		else if(strncmp(a, "faultbench", 10) == 0)
+			faultbench(a, n);	/* see fault.c */
+		else if(strncmp(a, "qbench", 6) == 0)
+			qbench(a, n);	/* see qio.c */
+		else if(strncmp(a, "mntbench", 8) == 0)
+			mntbench(a, n);	/* see devmnt.c */
+		break;
+	case Kprofheapctlqid:
+		heapprofctl(a, n);
 		break;
 	default:
 		error(Ebadusefd);
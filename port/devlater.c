@@ -25,8 +25,17 @@
  * that would mean that people calling walk by hand on the mount driver
  * would be mistaken. Thus, better to expose the lazy evaluation on the caller.
  * 
+ * With *laterread set, opening a cached file for reading also
+ * reads its first Nprefetch bytes and stats it in the same round
+ * trip, and leaves the data in the mount cache for the first read.
  */
 
+enum
+{
+	Nprefetch = 16*KiB,	/* data read on open */
+	Nprefetchst = 512,	/* room for the stat on open */
+};
+
 extern void	mntfree(Mntrpc*);
 extern int	mntabort(Mntrpc*);
 extern Mntrpc*	mntclunked(Mntrpc *r);
@@ -39,10 +48,13 @@ extern Mntrpc*	mntopencreated(Mntrpc *r, Chan **cp);
 extern Mntrpc*	mntopencreating(Mntrpc *prev, int type, Chan *c, char *name, int omode, ulong perm);
 extern Mntrpc*	mntstated(Mntrpc *r, uchar *dp, long *np);
 extern Mntrpc*	mntstating(Mntrpc *prev, Chan *c);
+extern Mntrpc*	mntkreading(Mntrpc *prev, Chan *c, void *buf, long n, vlong off);
+extern Mntrpc*	mntrdwred(Mntrpc *r, long *np);
 extern Chan*	clwalk(Chan *c, Path *p);
 
 
 int nolater;
+static int laterread;
 
 static int
 canwalklater(Chan *c)
@@ -65,6 +77,9 @@ walklater(Chan *c, Path *p)
 
 	if(!canwalklater(c))
 		return nil;
+	/* let the walk fail right now, without rpcs */
+	if(p->nres < p->nels && cnegwalk(c, p->els[p->nres]))
+		return nil;
 
 	DBG("walk later %N → %N\n", c->path, p);
 	nc = devattach(L'λ', "");
@@ -133,7 +148,13 @@ lrwstat(Chan *c, uchar *dp, long nd, long isw)
 	Mntrpc *r0, *r;
 	Path *p;
 	Walkqid *wq;
+	long n;
 
+	if(!isw && (n = cattr(c, dp, nd)) > 0){
+		cclose(c->lchan);
+		c->lchan = nil;
+		return n;
+	}
 	p = c->path;
 	r0 = mntwalking(c->lchan, p->els+p->nres, p->nels - p->nres);
 	if(waserror()){
@@ -157,6 +178,8 @@ lrwstat(Chan *c, uchar *dp, long nd, long isw)
 	mntclunked(r);
 	poperror();
 	mntfree(r0);
+	if(!isw)
+		cattrput(c, dp, nd);
 	cclose(c->lchan);	/* usually just a decref */
 	c->lchan = nil;
 
@@ -218,24 +241,80 @@ lremove(Chan *c)
 	c->lchan = nil;
 }
 
+/*
+ * Read the first bytes and stat after opening c?
+ */
+static int
+canprefetch(Chan *c, int type, int omode)
+{
+	return laterread && type == Topen && (c->flag&CCACHE) != 0 &&
+		(omode&(OTRUNC|3)) == OREAD;
+}
+
+/*
+ * Collect the data read and the stat made after opening nc
+ * for the λ chan c.
+ * The open is done; errors here just lose the data.
+ */
+static void
+lprefetched(Chan *c, Chan *nc, Mntrpc *r0, Mntrpc *r, uchar *buf)
+{
+	uchar *dp;
+	long n, nd, count;
+
+	count = r->request.count;
+	if(waserror()){
+		mntabort(r0);
+		return;
+	}
+	r = mntrdwred(r, &n);
+	dp = buf+Nprefetch;
+	nd = Nprefetchst;
+	mntstated(r, dp, &nd);
+	poperror();
+	mntfree(r0);
+	if(nd > BIT16SZ){
+		cattrput(c, dp, nd);
+		if(GBIT32(dp+9) != nc->qid.vers)	/* changed meanwhile */
+			return;
+	}
+	cprefetched(nc, buf, n, count);
+}
+
 static Chan*
 lopenncreate(int type, Chan *c, char *name, int omode, int perm)
 {
 	Chan *nc;
-	Mntrpc *r0, *r;
+	Mntrpc *r0, *r, *rp;
 	Path *p;
 	Walkqid *wq;
+	uchar *buf;
+	Mnt *mnt;
 
 	if(c->lchan == nil)
 		panic("devlater: called too late pc %#p", getcallerpc(&c));
 	p = c->path;
 	DBG("lopenncreate %N", p);
+	buf = nil;
+	if(canprefetch(c, type, omode))
+		buf = malloc(Nprefetch+Nprefetchst);
 	r0 = mntwalking(c->lchan, p->els+p->nres, p->nels - p->nres);
 	if(waserror()){
 		mntabort(r0);
+		free(buf);
 		nexterror();
 	}
-	mntopencreating(r0, type, r0->wq->clone, name, omode, perm);
+	rp = mntopencreating(r0, type, r0->wq->clone, name, omode, perm);
+	if(buf != nil){
+		/* iounit is not known until Ropen; mntopencreated sets it */
+		mnt = c->lchan->mchan->mux;
+		nc = r0->wq->clone;
+		nc->iounit = Nprefetch;
+		if(nc->iounit > mnt->msize-IOHDRSZ)
+			nc->iounit = mnt->msize-IOHDRSZ;
+		rp = mntkreading(rp, nc, buf, Nprefetch, 0);
+		mntstating(rp, nc);
+	}
 	r = mntwalked(r0, &wq);
 	if(wq == nil || wq->nqid < p->nels-p->nres)
 		error(up->errstr);
@@ -244,7 +323,11 @@ lopenncreate(int type, Chan *c, char *name, int omode, int perm)
 	r0->wq->clone = nil;
 
 	poperror();
-	mntfree(r0);
+	if(buf != nil){
+		lprefetched(c, nc, r0, rp, buf);
+		free(buf);
+	}else
+		mntfree(r0);
 	cclose(c->lchan);	/* usually just a decref */
 	c->lchan = nil;
 	cclose(c);
@@ -343,8 +426,12 @@ lbwrite(Chan *c, Block *bp, vlong off)
 static void
 laterinit(void)
 {
+	char *s;
+
 	if(getconf("*nolater"))
 		nolater = 1;
+	if((s = getconf("*laterread")) != nil)
+		laterread = atoi(s);
 }
 
 Dev laterdevtab = {
@@ -10,6 +10,9 @@
  * 9P2000.ix RPCs can share the same tag if they make a group.
  * They are linked through Mntrpc.tagnext in such case, and Mntrpc.owntag
  * indicates if deallocation of the RPC implies a deallocation of the tag.
+ * Pending RPCs are also hashed by tag in the Mnt, so that replies are
+ * matched in constant time; those in a group stay in the order sent,
+ * which is the order the server replies to them.
  *
  * References are managed as follows:
  * The channel to the server - a network connection or pipe - has one
@@ -30,8 +33,13 @@ enum
 	NMASK = (64*1024)>>TAGSHIFT,
 
 	MAXDATA = 8192,
-	MAXRPC = IOHDRSZ+MAXDATA,
+	MAXRPC = IOHDRSZ+MAXDATA,	/* rpc buffer kept in each Mntrpc */
+	DEFMSIZE = IOHDRSZ+1024*1024,	/* msize asked for by default */
+	MAXMSIZE = IOHDRSZ+2*1024*1024,	/* largest msize accepted */
 	NRPCS = 0,		/* rpcs kept in free list; 0: unlimited */
+	NBUFSZ = 9,		/* large rpc buffers are IOHDRSZ+(MAXDATA<<i) */
+	NBUFS = 4,		/* large rpc buffers kept per size */
+	MAXBREAD = 64*1024,	/* max. bytes read from the server at once */
 };
 
 struct Mntalloc
@@ -43,6 +51,8 @@ struct Mntalloc
 	Mntrpc*	rpcfreetl;
 	int	nrpcfree;
 	int	nrpcused;
+	uchar*	buffree[NBUFSZ];	/* large rpc buffers, by size */
+	int	nbuffree[NBUFSZ];
 	uint	id;
 	ulong	tagmask[NMASK];
 }mntalloc;
@@ -61,19 +71,53 @@ void	mountmux(Mnt*, Mntrpc*);
 void	mountrpcreq(Mnt*, Mntrpc*);
 void	mountrpcrep(Mntrpc*);
 int	rpcattn(void*);
+int	rpcdone(void*);
+static void	rpcbufget(Mntrpc*, ulong);
+static void	mntstat(int, Chan*, uvlong, ulong);
+static int	mntkdata(Mnt*, Mntrpc*, int, int);
 Chan*	mntchan(void);
 
 char	Esbadstat[] = "invalid directory entry received from server";
 char	Enoversion[] = "version not established for mount channel";
 
 void (*mntstats)(int, Chan*, uvlong, ulong);
+
+/*
+ * RPC statistics kept per mount, by T-message type.
+ * lat[i] counts rpcs that took less than 2^i µs (the last one, the rest).
+ * Updated only by the proc reading replies for the mount.
+ */
+enum
+{
+	NLAT = 24,
+	NSTATTYPE = (Tmax-Tversion)/2,
+};
+
+typedef struct Mntstat Mntstat;
+struct Mntstat
+{
+	ulong	n;
+	uvlong	bytes;
+	uvlong	us;
+	ulong	lat[NLAT];
+};
+
+struct Mntstats
+{
+	Mntstat	t[NSTATTYPE];
+	ulong	nsent;
+	uvlong	sumdepth;
+	int	maxdepth;
+};
+static int mntprocs;	/* use a demultiplexer kproc per mount */
+static ulong kdatacnt;	/* Rreads copied by mntkdata */
 #pragma	varargck	type	"G"	Fcall*
 
 static char*
 mntsummary(char *s, char *e, void*)
 {
-	return seprint(s, e, "%d/%d rpcs\n",
-		mntalloc.nrpcused, mntalloc.nrpcused+mntalloc.nrpcfree);
+	return seprint(s, e, "%d/%d rpcs %lud direct rreads\n",
+		mntalloc.nrpcused, mntalloc.nrpcused+mntalloc.nrpcfree, kdatacnt);
 }
 
 #define	QIDFMT	"(%.16llux %lud %x)"
@@ -206,13 +250,19 @@ devmntdump(void*)
 	for(mnt = mntalloc.list; mnt != nil; mnt = mnt->list){
 		c = mnt->c;
 		p = mnt->rip;
-		print("mnt %N rip %d\n", c->path, p?p->pid:0);
+		print("mnt %N rip %d", c->path, p?p->pid:0);
+		p = mnt->mproc;
+		if(mnt->muxproc)
+			print(" mproc %d%s", p?p->pid:0, mnt->hungup?" hungup":"");
+		print("\n");
 	}
 }
 
 static void
 mntreset(void)
 {
+	char *s;
+
 	mntalloc.id = 1;
 	mntalloc.tagmask[0] = 1;			/* don't allow 0 as a tag */
 	mntalloc.tagmask[NMASK-1] = 0x80000000UL;	/* don't allow NOTAG */
@@ -222,10 +272,78 @@ mntreset(void)
 	fmtinstall('D', dirfmt);
 
 	addsummary(mntsummary, nil);
+	mntstats = mntstat;
 	addttescape('M', devmntdump, nil);
+	if((s=getconf("*mntproc")) != nil)
+		mntprocs = atoi(s);
 	cinit();
 }
 
+/*
+ * With *mntproc set, a kproc per mount reads all the replies and
+ * hands them to the waiting rpcs, instead of gating the callers
+ * to take turns as the reader.  It reads only while there are
+ * rpcs pending, so it never uses mnt->c after the last clunk.
+ * If the connection fails, pending rpcs get Ehungup, and so
+ * do the rpcs issued later.
+ */
+static int
+mntprocattn(void *a)
+{
+	Mnt *mnt;
+
+	mnt = a;
+	return mnt->queuehd != nil || mnt->closing;
+}
+
+static void
+mntproc(void *a)
+{
+	Mnt *mnt;
+	Mntrpc *r, *q;
+
+	mnt = a;
+	lock(mnt);
+	mnt->mproc = up;
+	unlock(mnt);
+	r = mntralloc(nil, nil, mnt->msize, -1);
+	if(!waserror()){
+		for(;;){
+			sleep(&mnt->mr, mntprocattn, mnt);
+			if(mnt->closing)
+				break;
+			if(mntrpcread(mnt, r) < 0)
+				break;
+			mountmux(mnt, r);
+		}
+		poperror();
+	}
+	DBG("mntproc %d: %s\n", mnt->id, mnt->closing? "closing" : "hungup");
+	lock(mnt);
+	mnt->hungup = 1;
+	while((q = mnt->queuehd) != nil){
+		q->reply.type = Rerror;
+		q->reply.ename = Ehungup;
+		mntqrm(mnt, q, 1);
+		wakeup(&q->r);
+	}
+	mnt->mproc = nil;
+	mnt->muxproc = 0;
+	wakeup(&mnt->cr);
+	unlock(mnt);
+	mntfree(r);
+	pexit("", 1);
+}
+
+static int
+mntprocgone(void *a)
+{
+	Mnt *mnt;
+
+	mnt = a;
+	return mnt->muxproc == 0;
+}
+
 /*
  * Version is not multiplexed: message sent only once per connection.
  */
@@ -252,7 +370,7 @@ mntversion(Chan *c, u32int msize, char *version, usize returnlen)
 
 	/* defaults */
 	if(msize == 0)
-		msize = MAXRPC;
+		msize = DEFMSIZE;
 	if(msize > c->iounit && c->iounit != 0)
 		msize = c->iounit;
 	v = version;
@@ -336,7 +454,7 @@ mntversion(Chan *c, u32int msize, char *version, usize returnlen)
 	}
 	if(f->msize > msize)
 		error("server tries to increase msize in fversion");
-	if(f->msize<256 || f->msize>1024*1024)
+	if(f->msize<256 || f->msize>MAXMSIZE)
 		error("nonsense value of msize in fversion");
 	k = strlen(f->version);
 	if(strncmp(f->version, v, k) != 0){
@@ -371,6 +489,14 @@ mntversion(Chan *c, u32int msize, char *version, usize returnlen)
 	mnt->q = qopen(0x7fffffff, 0, nil, nil);
 	mnt->msize = f->msize;
 	unlock(&mntalloc);
+	if(mnt->stats == nil)
+		mnt->stats = malloc(sizeof(Mntstats));
+	else
+		memset(mnt->stats, 0, sizeof(Mntstats));
+	if(mnt->q != nil){
+		snprint(buf, sizeof buf, "mnt/%d", mnt->id);
+		qsetname(mnt->q, buf);
+	}
 
 	if(returnlen != 0){
 		if(returnlen < k)
@@ -385,11 +511,20 @@ mntversion(Chan *c, u32int msize, char *version, usize returnlen)
 	mnt->queuehd = nil;
 	mnt->queuetl = nil;
 	mnt->rip = nil;
+	mnt->muxproc = mntprocs;
+	mnt->mproc = nil;
+	mnt->closing = 0;
+	mnt->hungup = 0;
+	mnt->nqueued = 0;
 
 	c->flag |= CMSG;
 	c->mux = mnt;
 	mnt->c = c;
 	unlock(mnt);
+	if(mnt->muxproc){
+		snprint(buf, sizeof buf, "mntproc%d", mnt->id);
+		kproc(buf, mntproc, mnt);
+	}
 
 	poperror();	/* c */
 	qunlock(&c->umqlock);
@@ -406,7 +541,7 @@ mntauth(Chan *c, char *spec)
 	mnt = c->mux;
 
 	if(mnt == nil){
-		mntversion(c, MAXRPC, VERSION9PIX, 0);
+		mntversion(c, 0, VERSION9PIX, 0);
 		mnt = c->mux;
 		if(mnt == nil)
 			error(Enoversion);
@@ -605,10 +740,18 @@ mntwalked(Mntrpc *r, Walkqid **wqp)
 	wq = r->wq;
 	nname = wq->nqid;
 	wq->nqid = 0;
+	if(waserror()){
+		if(nname > 0 && strstr(up->errstr, "does not exist") != nil)
+			cnegput(c, c->qid, r->request.wname[0]);
+		nexterror();
+	}
 	mountrpcrep(r);
+	poperror();
 	if(r->reply.nwqid > nname)
 		error("too many QIDs returned by walk");
 	if(r->reply.nwqid < nname){
+		i = r->reply.nwqid;
+		cnegput(c, i == 0 ? c->qid : r->reply.wqid[i-1], r->request.wname[i]);
 		if(r->reply.nwqid == 0){
 			/* nc won't be free until mntfree(r) */
 			wq = nil;
@@ -625,8 +768,10 @@ mntwalked(Mntrpc *r, Walkqid **wqp)
 	if(r->reply.nwqid > 0)
 		wq->clone->qid = r->reply.wqid[r->reply.nwqid-1];
 	wq->nqid = r->reply.nwqid;
-	for(i=0; i < wq->nqid; i++)
+	for(i=0; i < wq->nqid; i++){
 		wq->qid[i] = r->reply.wqid[i];
+		cattrqid(c, wq->qid[i]);
+	}
 
     Return:
 	*wqp = wq;
@@ -641,6 +786,8 @@ mntwalk(Chan *c, Chan *nc, char **name, int nname)
 
 	if(nc != nil)
 		panic("mntwalk: not supported; since lib9p can, so do I");
+	if(nname > 0 && cnegwalk(c, name[0]))
+		error(Enonexist);
 	r = mntwalking(c, name, nname);
 	if(waserror()){
 		mntabort(r);
@@ -736,7 +883,15 @@ mntopencreated(Mntrpc *r, Chan **cp)
 	mountrpcrep(r);
 	c = r->c;
 	mnt = mntchk(c);
+	if(r->request.type == Tcreate){
+		cattrinval(c, c->qid);	/* the directory */
+		cneginval(c, r->request.name);
+	}
 	c->qid = r->reply.qid;
+	if(r->request.type == Tcreate || (r->request.mode&OTRUNC) != 0)
+		cattrinval(c, c->qid);
+	else
+		cattrqid(c, c->qid);
 	c->offset = 0;
 	c->mode = openmode(r->request.mode);
 	c->iounit = r->reply.iounit;
@@ -813,7 +968,12 @@ mntclunking(Mntrpc *prev, Chan *c, int t)
 Mntrpc*
 mntclunked(Mntrpc *r)
 {
+	Chan *c;
+
 	mountrpcrep(r);
+	c = r->c;
+	if(r->request.type == Tremove || ((c->flag&COPEN) != 0 && c->mode != OREAD))
+		cattrinval(c, c->qid);
 	return r->tagnext;
 }
 
@@ -822,6 +982,11 @@ mntclunk(Chan *c, int t)
 {
 	Mntrpc *r;
 
+	/* errors from write-behind are lost on close */
+	if(!waserror()){
+		cflushed(c);
+		poperror();
+	}
 	r = mntclunking(nil, c, t);
 	if(waserror()){
 		mntabort(r);
@@ -838,6 +1003,18 @@ muxclose(Mnt *mnt)
 	Mntrpc *r;
 
 	lock(mnt);
+	if(mnt->muxproc){
+		/* stop mproc, interrupting any read in progress */
+		mnt->closing = 1;
+		if(mnt->mproc != nil)
+			postnote(mnt->mproc, 0, "mnt closing", NUser);
+		unlock(mnt);
+		while(waserror())
+			;
+		sleep(&mnt->cr, mntprocgone, mnt);
+		poperror();
+		lock(mnt);
+	}
 	while(mnt->queuehd != nil){
 		r = mnt->queuehd;
 		if(r->tagnext != nil)
@@ -908,6 +1085,10 @@ Mntrpc*
 mntwstated(Mntrpc *r)
 {
 	mountrpcrep(r);
+	cattrinval(r->c, r->c->qid);
+	/* renamed: name[s] follows size[2] type[2] dev[4] qid[13] mode[4] atime[4] mtime[4] length[8] */
+	if(r->request.nstat >= 43 && GBIT16(r->request.stat+41) != 0)
+		cneginval(r->c, nil);
 	return r->tagnext;
 }
 
@@ -927,8 +1108,8 @@ mntwstat(Chan *c, uchar *dp, long n)
 	return n;
 }
 
-Mntrpc*
-mntrdwring(Mntrpc *prev, int type, Chan *c, void *buf, long n, vlong off)
+static Mntrpc*
+rdwring(Mntrpc *prev, int type, Chan *c, void *buf, long n, vlong off, int kdata)
 {
 	Mnt *mnt;
  	Mntrpc *r;
@@ -943,9 +1124,28 @@ mntrdwring(Mntrpc *prev, int type, Chan *c, void *buf, long n, vlong off)
 	r->request.offset = off;
 	r->request.data = buf;
 	r->request.count = n;
+	r->kdata = kdata;
 	return mntreqing(mnt, r, prev);
 }
 
+Mntrpc*
+mntrdwring(Mntrpc *prev, int type, Chan *c, void *buf, long n, vlong off)
+{
+	return rdwring(prev, type, c, buf, n, off, 0);
+}
+
+/*
+ * Like mntrdwring(Tread), but buf is kernel memory (e.g., a
+ * kmapped cache page) and the reply data is copied there by
+ * whoever reads the reply, straight from the input queue.
+ * buf must stay valid until the rpc is done or aborted.
+ */
+Mntrpc*
+mntkreading(Mntrpc *prev, Chan *c, void *buf, long n, vlong off)
+{
+	return rdwring(prev, Tread, c, buf, n, off, 1);
+}
+
 Mntrpc*
 mntrdwred(Mntrpc *r, long *np)
 {
@@ -955,7 +1155,7 @@ mntrdwred(Mntrpc *r, long *np)
 	n = r->request.count;
 	if(r->reply.count < n)
 		n = r->reply.count;
-	if(r->request.type == Tread && r->request.data != nil)
+	if(r->request.type == Tread && r->request.data != nil && !r->kdata)
 		r->b = bl2mem((uchar*)r->request.data, r->b, n);
 	if(np != nil)
 		*np = n;
@@ -1028,7 +1228,8 @@ mntwrite(Chan *c, void *buf, long n, vlong off)
 void
 mountrpcreq(Mnt *mnt, Mntrpc *r)
 {
-	int n;
+	int n, t, wl;
+	Mntstats *st;
 
 	r->reply.tag = 0;
 	r->reply.type = Tmax;	/* can't ever be a valid message type */
@@ -1040,30 +1241,67 @@ mountrpcreq(Mnt *mnt, Mntrpc *r)
 	DBG("send pid %d %G\n", up->pid, &r->request);
 	r->pid = up->pid;
 	r->m = mnt;
-	if(mnt->queuetl == nil)
+	if(mnt->hungup){
+		r->done = 1;
+		unlock(mnt);
+		error(Ehungup);
+	}
+	if(mnt->queuetl == nil){
 		mnt->queuehd = r;
-	else {
+		if(mnt->muxproc)
+			wakeup(&mnt->mr);
+	}else {
 		mnt->queuetl->next = r;
 		r->prev = mnt->queuetl;
 	}
 	mnt->queuetl = r;
+	mnt->nqueued++;
+	if((st = mnt->stats) != nil){
+		st->nsent++;
+		st->sumdepth += mnt->nqueued;
+		if(mnt->nqueued > st->maxdepth)
+			st->maxdepth = mnt->nqueued;
+	}
+	t = TAGH(r->request.tag);
+	if(mnt->tagtl[t] == nil)
+		mnt->taghd[t] = r;
+	else {
+		mnt->tagtl[t]->hnext = r;
+		r->hprev = mnt->tagtl[t];
+	}
+	mnt->tagtl[t] = r;
 	unlock(mnt);
 
 	/* Transmit a file system rpc */
 	if(mnt->msize == 0)
 		panic("msize");
-	n = convS2M(&r->request, r->rpc, mnt->msize);
-	if(n < 0)
+	n = sizeS2M(&r->request);
+	if(n > r->rpclen)
+		rpcbufget(r, n);
+	n = convS2M(&r->request, r->rpc, r->rpclen);
+	if(n <= 0)
 		panic("bad message type in mountrpcreq");
+
+	/*
+	 * Writes larger than qiomaxatomic may be split by the
+	 * transport and interleaved with those of other procs.
+	 */
+	wl = mnt->msize > qiomaxatomic;
+	if(wl)
+		qlock(&mnt->wlk);
 	if(waserror()){
 		DBG("send err tag %d\n", r->request.tag);
+		if(wl)
+			qunlock(&mnt->wlk);
 		mntqrm(mnt, r, 0);
 		nexterror();
 	}
-	if(mnt->c->dev->write(mnt->c, r->rpc, n, 0) != n)
-		error(Emountrpc);
 	r->stime = fastticks(nil);
 	r->reqlen = n;
+	if(mnt->c->dev->write(mnt->c, r->rpc, n, 0) != n)
+		error(Emountrpc);
+	if(wl)
+		qunlock(&mnt->wlk);
 	poperror();
 }
 
@@ -1081,6 +1319,12 @@ mountrpcrep(Mntrpc *r)
 		nexterror();
 	}
 
+	/* mproc reads for us; just wait for the reply */
+	if(mnt->muxproc){
+		sleep(&r->r, rpcdone, r);
+		goto Done;
+	}
+
 	/* Gate readers onto the mount point one at a time */
 	for(;;) {
 		lock(mnt);
@@ -1152,9 +1396,16 @@ static int
 doread(Mnt *mnt, int len)
 {
 	Block *b;
+	long n;
 
+	n = mnt->msize;
+	if(n > MAXBREAD)
+		n = MAXBREAD;
 	while(qlen(mnt->q) < len){
-		b = mnt->c->dev->bread(mnt->c, mnt->msize, 0);
+		if(mnt->c->dev->dc == '|')
+			b = pipebreadlist(mnt->c, n);
+		else
+			b = mnt->c->dev->bread(mnt->c, n, 0);
 		if(b == nil)
 			return -1;
 		if(blocklen(b) == 0){
@@ -1182,6 +1433,7 @@ mntrpcread(Mnt *mnt, Mntrpc *r)
 
 	/* read in the rest of the message, avoid ridiculous (for now) message sizes */
 	len = GBIT32(nb->rp);
+	r->replen = len;
 	if(len > mnt->msize){
 		DBG("mntrpcread discard\n");
 		qdiscard(mnt->q, qlen(mnt->q));
@@ -1212,6 +1464,8 @@ mntrpcread(Mnt *mnt, Mntrpc *r)
 	/* hang the data off of the fcall struct */
 	freeblist(r->b);
 	r->b = nil;
+	if(t == Rread && mntkdata(mnt, r, hlen, len))
+		return 0;
 	l = &r->b;
 	do {
 		b = qremove(mnt->q);
@@ -1240,6 +1494,48 @@ mntrpcread(Mnt *mnt, Mntrpc *r)
 	return 0;
 }
 
+/*
+ * If the Rread in r is for a mntkreading rpc, copy its data to
+ * the destination and drop the message from the queue.
+ * The Mnt lock keeps mntabort from releasing the rpc (and
+ * the caller its buffer) while we copy.
+ */
+static int
+mntkdata(Mnt *mnt, Mntrpc *r, int hlen, int len)
+{
+	Mntrpc *q;
+	uchar *p;
+	long n, tot;
+	int nc;
+
+	lock(mnt);
+	for(q = mnt->taghd[TAGH(r->reply.tag)]; q != nil; q = q->hnext)
+		if(q->request.tag == r->reply.tag)
+			break;
+	if(q == nil || !q->kdata || q->request.type != Tread){
+		unlock(mnt);
+		return 0;
+	}
+	qdiscard(mnt->q, hlen);
+	len -= hlen;
+	n = r->reply.count;
+	if(n > q->request.count)
+		n = q->request.count;
+	if(n > len)
+		n = len;
+	p = q->request.data;
+	for(tot = 0; tot < n; tot += nc)
+		if((nc = qconsume(mnt->q, p+tot, n-tot)) <= 0)
+			panic("mntkdata: short queue");
+	unlock(mnt);
+	if(len > n)
+		qdiscard(mnt->q, len-n);
+	r->reply.count = n;
+	r->reply.data = nil;
+	kdatacnt++;
+	return 1;
+}
+
 void
 mntgate(Mnt *mnt)
 {
@@ -1257,10 +1553,13 @@ void
 mountmux(Mnt *mnt, Mntrpc *r)
 {
 	Mntrpc *q;
+	int type;
+	uvlong stime;
+	ulong n;
 
 	DBG("mux pid %d %G\n",up->pid, &r->reply);
 	lock(mnt);
-	for(q = mnt->queuehd; q != nil; q = q->next)
+	for(q = mnt->taghd[TAGH(r->reply.tag)]; q != nil; q = q->hnext)
 		if(q->request.tag == r->reply.tag) {		/* reply to a message */
 			if(q != r) {
 				/*
@@ -1291,13 +1590,15 @@ mountmux(Mnt *mnt, Mntrpc *r)
 				q->c->dev = nil;
 				q->c->devno = 0;
 			}
+			/* q may be freed once awake */
+			type = q->request.type;
+			stime = q->stime;
+			n = q->reqlen + r->replen;
 			if(q != r)
 				wakeup(&q->r);
 			unlock(mnt);
 			if(mntstats != nil)
-				(*mntstats)(q->request.type,
-					mnt->c, q->stime,
-					q->reqlen + r->replen);
+				(*mntstats)(type, mnt->c, stime, n);
 			return;
 		}
 	unlock(mnt);
@@ -1352,8 +1653,68 @@ freetag(int t)
 	mntalloc.tagmask[t>>TAGSHIFT] &= ~(1<<(t&TAGMASK));
 }
 
+/*
+ * Each Mntrpc has a MAXRPC buffer. Requests that do not fit
+ * (e.g., large Twrites) borrow a large buffer until mntfree.
+ */
+static int
+rpcbufsz(int i)
+{
+	return IOHDRSZ+(MAXDATA<<i);
+}
+
+static void
+rpcbufget(Mntrpc *r, ulong n)
+{
+	int i;
+	uchar *p;
+
+	for(i = 1; i < NBUFSZ-1 && rpcbufsz(i) < n; i++)
+		;
+	if(rpcbufsz(i) < n || r->srpc != nil)
+		panic("rpcbufget: %lud bytes", n);
+	lock(&mntalloc);
+	p = mntalloc.buffree[i];
+	if(p != nil){
+		mntalloc.buffree[i] = *(uchar**)p;
+		mntalloc.nbuffree[i]--;
+	}
+	unlock(&mntalloc);
+	if(p == nil){
+		p = mallocz(rpcbufsz(i), 0);
+		if(p == nil)
+			exhausted("mount rpc buffer");
+	}
+	r->srpc = r->rpc;
+	r->rpc = p;
+	r->rpclen = rpcbufsz(i);
+}
+
+static void
+rpcbufput(Mntrpc *r)
+{
+	int i;
+	uchar *p;
+
+	p = r->rpc;
+	for(i = 1; i < NBUFSZ-1 && rpcbufsz(i) != r->rpclen; i++)
+		;
+	r->rpc = r->srpc;
+	r->rpclen = MAXRPC;
+	r->srpc = nil;
+	lock(&mntalloc);
+	if(mntalloc.nbuffree[i] < NBUFS){
+		*(uchar**)p = mntalloc.buffree[i];
+		mntalloc.buffree[i] = p;
+		mntalloc.nbuffree[i]++;
+		p = nil;
+	}
+	unlock(&mntalloc);
+	free(p);
+}
+
 Mntrpc*
-mntralloc(Mntrpc *prev, Chan *c, ulong msize, int sharetags)
+mntralloc(Mntrpc *prev, Chan *c, ulong, int sharetags)
 {
 	Mntrpc *new;
 
@@ -1368,12 +1729,12 @@ mntralloc(Mntrpc *prev, Chan *c, ulong msize, int sharetags)
 		 * The header is split from the data buffer as
 		 * mountmux may swap the buffer with another header.
 		 */
-		new->rpc = mallocz(MAX(msize, MAXRPC), 0);
+		new->rpc = mallocz(MAXRPC, 0);
 		if(new->rpc == nil){
 			free(new);
 			exhausted("mount rpc buffer");
 		}
-		new->rpclen = MAX(msize, MAXRPC);
+		new->rpclen = MAXRPC;
 		new->b = nil;
 		lock(&mntalloc);
 	}else{
@@ -1382,16 +1743,6 @@ mntralloc(Mntrpc *prev, Chan *c, ulong msize, int sharetags)
 			mntalloc.rpcfreetl = nil;
 		new->next = nil;
 		mntalloc.nrpcfree--;
-		if(new->rpclen < msize){
-			free(new->rpc);
-			new->rpc = mallocz(MAX(msize, MAXRPC), 0);
-			if(new->rpc == nil){
-				free(new);
-				unlock(&mntalloc);
-				exhausted("mount rpc buffer");
-			}
-			new->rpclen = MAX(msize, MAXRPC);
-		}
 	}
 	assert(new->b == nil);
 	if(sharetags < 0)
@@ -1409,6 +1760,7 @@ mntralloc(Mntrpc *prev, Chan *c, ulong msize, int sharetags)
 	unlock(&mntalloc);
 	new->c = c;
 	new->done = 0;
+	new->kdata = 0;
 	new->flushed = nil;
 	new->request.type = 0;
 	new->reply.type = 0;
@@ -1445,6 +1797,8 @@ mntfree(Mntrpc *r)
 	if(r->b != nil)
 		freeblist(r->b);
 	r->b = nil;
+	if(r->srpc != nil)
+		rpcbufput(r);
 	while(r->tagnext != nil){
 		tn = r->tagnext;
 		r->tagnext = tn->tagnext;
@@ -1567,6 +1921,8 @@ mntabort(Mntrpc *r0)
 void
 mntqrm(Mnt *mnt, Mntrpc *r, int locked)
 {
+	int t;
+
 	if(!locked)
 		lock(mnt);
 	if(r->done)
@@ -1585,6 +1941,19 @@ mntqrm(Mnt *mnt, Mntrpc *r, int locked)
 		mnt->queuetl = r->prev;
 	r->next = nil;
 	r->prev = nil;
+	mnt->nqueued--;
+
+	t = TAGH(r->request.tag);
+	if(r->hprev != nil)
+		r->hprev->hnext = r->hnext;
+	else
+		mnt->taghd[t] = r->hnext;
+	if(r->hnext != nil)
+		r->hnext->hprev = r->hprev;
+	else
+		mnt->tagtl[t] = r->hprev;
+	r->hnext = nil;
+	r->hprev = nil;
 	if(!locked)
 		unlock(mnt);
 }
@@ -1636,6 +2005,203 @@ rpcattn(void *v)
 	return r->done || r->m->rip == 0;
 }
 
+int
+rpcdone(void *v)
+{
+	Mntrpc *r;
+
+	r = v;
+	return r->done;
+}
+
+/*
+ *  benchmark: nproc kprocs read the same file at once on a
+ *  mount, nread times each, to compare gated readers with *mntproc.
+ *  Mount it without caching to measure the rpcs.
+ *	mntbench nproc nread file
+ */
+typedef struct Mntbench Mntbench;
+struct Mntbench
+{
+	Chan*	c;
+	int	nproc;
+	int	nread;
+	int	stop;
+	Lock;			/* held for ndone++ and its wakeup */
+	vlong	nbytes;
+	int	ndone;
+	Rendez	r;
+};
+
+static int
+mntbenchdone(void *a)
+{
+	Mntbench *mb = a;
+
+	return mb->ndone == mb->nproc;
+}
+
+static void
+mntbenchrd(void *a)
+{
+	Mntbench *mb;
+	Chan *c;
+	uchar *buf;
+	long n, tot;
+	int i;
+
+	mb = a;
+	c = mb->c;
+	n = c->iounit;
+	if(n == 0)
+		n = MAXDATA;
+	buf = nil;
+	tot = 0;
+	if(!waserror()){
+		buf = smalloc(n);
+		for(i = 0; i < mb->nread && !mb->stop; i++)
+			tot += c->dev->read(c, buf, n, 0);
+		poperror();
+	}
+	free(buf);
+	lock(mb);
+	mb->nbytes += tot;
+	mb->ndone++;
+	wakeup(&mb->r);
+	unlock(mb);
+	pexit("", 1);
+}
+
+void
+mntbench(char *a, long n)
+{
+	Cmdbuf *cb;
+	Mntbench *mb;
+	Chan *c;
+	int i;
+	uvlong t0, ns, nr;
+
+	cb = parsecmd(a, n);
+	if(waserror()){
+		free(cb);
+		nexterror();
+	}
+	if(cb->nf != 4)
+		error(Ebadctl);
+	c = namec(cb->f[3], Aopen, OREAD, 0);
+	if(waserror()){
+		cclose(c);
+		nexterror();
+	}
+	if(c->dev->dc != 'M')
+		error("mntbench: not a mounted file");
+	mb = smalloc(sizeof *mb);
+	mb->c = c;
+	mb->nproc = strtol(cb->f[1], 0, 0);
+	mb->nread = strtol(cb->f[2], 0, 0);
+	if(mb->nproc <= 0 || mb->nproc > 1024 || mb->nread <= 0){
+		free(mb);
+		error(Ebadarg);
+	}
+	poperror();
+	poperror();
+	free(cb);
+
+	t0 = fastticks(nil);
+	for(i = 0; i < mb->nproc; i++)
+		kproc("mntbench", mntbenchrd, mb);
+	while(waserror())
+		mb->stop = 1;
+	sleep(&mb->r, mntbenchdone, mb);
+	poperror();
+	ns = fastticks2ns(fastticks(nil) - t0);
+
+	nr = (uvlong)mb->nproc*mb->nread;
+	print("mntbench%s: %d procs, %llud reads, %lld bytes: %llud ns, %llud ns/read\n",
+		c->mchan->mux->muxproc? " mntproc" : "", mb->nproc, nr,
+		mb->nbytes, ns, ns/nr);
+	cclose(c);
+	/* the last kproc may still be in its wakeup */
+	lock(mb);
+	unlock(mb);
+	free(mb);
+}
+
+static void
+mntstat(int type, Chan *c, uvlong stime, ulong n)
+{
+	Mnt *mnt;
+	Mntstat *s;
+	uvlong us;
+	int i;
+
+	mnt = c->mux;
+	i = (type-Tversion)/2;
+	if(mnt == nil || mnt->stats == nil || i < 0 || i >= NSTATTYPE)
+		return;
+	s = &mnt->stats->t[i];
+	us = fastticks2us(fastticks(nil) - stime);
+	s->n++;
+	s->bytes += n;
+	s->us += us;
+	for(i = 0; i < NLAT-1 && us >= (1ULL<<i); i++)
+		;
+	s->lat[i]++;
+}
+
+static char *stattypes[NSTATTYPE] = {
+	"Tversion", "Tauth", "Tattach", nil, "Tflush", "Twalk", "Topen",
+	"Tcreate", "Tread", "Twrite", "Tclunk", "Tremove", "Tstat", "Twstat",
+};
+
+/*
+ * A paragraph per mount: the server and rpc queue depth,
+ * and a line per message type used, with count, bytes, mean µs
+ * and the latency histogram.
+ */
+long
+mntstatsread(void *a, long n, vlong off)
+{
+	Mnt *mnt;
+	Mntstats *st;
+	Mntstat *s;
+	char *buf, *p, *e;
+	int i, j, nm, sz;
+
+	nm = 0;
+	lock(&mntalloc);
+	for(mnt = mntalloc.list; mnt != nil; mnt = mnt->list)
+		nm++;
+	unlock(&mntalloc);
+	sz = nm*(NSTATTYPE+2)*(64+NLAT*11) + 1;
+	p = buf = smalloc(sz);
+	e = buf + sz;
+	lock(&mntalloc);
+	for(mnt = mntalloc.list; mnt != nil && p < e; mnt = mnt->list){
+		if((st = mnt->stats) == nil || mnt->c == nil)
+			continue;
+		p = seprint(p, e, "mnt %ud %N msize %d %s\n",
+			mnt->id, mnt->c->path, mnt->msize, mnt->version);
+		p = seprint(p, e, "\tdepth %d max %d mean %llud\n",
+			mnt->nqueued, st->maxdepth,
+			st->nsent? st->sumdepth/st->nsent : 0);
+		for(i = 0; i < NSTATTYPE; i++){
+			s = &st->t[i];
+			if(s->n == 0 || stattypes[i] == nil)
+				continue;
+			p = seprint(p, e, "\t%s %lud %llud %llud lat",
+				stattypes[i], s->n, s->bytes, s->us/s->n);
+			for(j = 0; j < NLAT; j++)
+				p = seprint(p, e, " %lud", s->lat[j]);
+			p = seprint(p, e, "\n");
+		}
+	}
+	unlock(&mntalloc);
+	n = readstr(off, a, n, buf);
+	free(buf);
+	return n;
+}
+
 Dev mntdevtab = {
 	'M',
 	"mnt",
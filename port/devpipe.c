@@ -51,6 +51,7 @@ pipeattach(char *spec)
 {
 	Pipe *p;
 	Chan *c;
+	char name[32];
 
 	c = devattach('|', spec);
 	p = malloc(sizeof(Pipe));
@@ -73,6 +74,10 @@ pipeattach(char *spec)
 	lock(&pipealloc);
 	p->path = ++pipealloc.path;
 	unlock(&pipealloc);
+	snprint(name, sizeof name, "pipe/%lud/0", p->path);
+	qsetname(p->q[0], name);
+	snprint(name, sizeof name, "pipe/%lud/1", p->path);
+	qsetname(p->q[1], name);
 
 	mkqid(&c->qid, PIPEQID(2*p->path, Qdir), 0, QTDIR);
 	c->aux = p;
@@ -249,8 +254,8 @@ pipeclose(Chan *c)
 	p->ref--;
 	if(p->ref == 0){
 		qunlock(p);
-		free(p->q[0]);
-		free(p->q[1]);
+		qfree(p->q[0]);
+		qfree(p->q[1]);
 		free(p);
 	} else
 		qunlock(p);
@@ -293,6 +298,27 @@ pipebread(Chan *c, long n, vlong offset)
 	return devbread(c, n, offset);
 }
 
+/*
+ * Like pipebread, but may return several writes, one per block,
+ * for callers that take lists (eg. devmnt).
+ */
+Block*
+pipebreadlist(Chan *c, long n)
+{
+	Pipe *p;
+
+	p = c->aux;
+
+	switch(PIPETYPE(c->qid.path)){
+	case Qdata0:
+		return qbreadlist(p->q[0], n);
+	case Qdata1:
+		return qbreadlist(p->q[1], n);
+	}
+
+	return devbread(c, n, 0);
+}
+
 /*
  *  a write to a closed pipe causes a note to be sent to
  *  the process.
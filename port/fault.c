@@ -11,6 +11,41 @@
 
 extern char *segtypename[];
 
+/*
+ * Fault-around.
+ * On a read fault, also map up to this many pages near the
+ * faulting one that are already resident, within the same Pte,
+ * to save the traps for them. Indexed by segment type, and
+ * set with *faultaround<type> (e.g., *faultaroundtext=32).
+ * Only pages that need no copy on write are mapped.
+ */
+static struct
+{
+	char	*name;
+	int	n;
+} faround[] =
+{
+	[SG_TEXT]	"text",		16,
+	[SG_DATA]	"data",		8,
+	[SG_STACK]	"stack",	0,
+	[SG_SHARED]	"shared",	8,
+};
+
+void
+faultinit(void)
+{
+	int i;
+	char *p, name[32];
+
+	for(i = 0; i < nelem(faround); i++){
+		if(faround[i].name == nil)
+			continue;
+		seprint(name, name+sizeof name, "*faultaround%s", faround[i].name);
+		if((p = getconf(name)) != nil)
+			faround[i].n = strtoul(p, 0, 0);
+	}
+}
+
 int
 fault(uintptr addr, int read)
 {
@@ -178,6 +213,42 @@ pagein(Segment *s, uintptr addr, Page **pg)
 	poperror();
 }
 
+/*
+ * Map the resident pages around addr, which is being
+ * faulted in, with the mmuflags used for it.
+ * Called by fixfault with s->lk held.
+ */
+static void
+faultaround(Segment *s, uintptr addr, uint mmuflags)
+{
+	int n, type;
+	uintptr soff;
+	Pte *pte;
+	Page **pg, **p, **e;
+
+	type = s->type&SG_TYPE;
+	if(type >= nelem(faround) || (n = faround[type].n) <= 0)
+		return;
+	soff = addr - s->base;
+	pte = s->map[soff/s->ptemapmem];
+	if(pte == nil)
+		return;
+	pg = &pte->pages[(soff&(s->ptemapmem-1))>>s->pgszlg2];
+	p = pg - n/2;
+	if(p < pte->first)
+		p = pte->first;
+	e = p + n + 1;
+	if(e > pte->last + 1)
+		e = pte->last + 1;
+	for(; p < e; p++){
+		if(p == pg || *p == nil || (*p)->n == 0)
+			continue;
+		if(type != SG_TEXT && (*p)->ref != 1)
+			continue;	/* copy on write */
+		mmuput(up, *p, mmuflags);
+	}
+}
+
 /*
  * Called with s->lk locked to fix a fault.
  * Returns with s->lk unlocked.
@@ -191,7 +262,7 @@ pagein(Segment *s, uintptr addr, Page **pg)
 int
 fixfault(Segment *s, uintptr addr, int read, int dommuput)
 {
-	int type;
+	int type, around;
 	uint mmuflags;
 	uintptr pgsize;
 	Page **pg, *opg, *new;
@@ -210,6 +281,7 @@ fixfault(Segment *s, uintptr addr, int read, int dommuput)
 	pg = segwalk(s, addr, 1);
 	type = s->type&SG_TYPE;
 	mmuflags = 0;
+	around = dommuput && read;
 	DBG("fixfault pid %d s %N sref %d %s %#p addr %#p pg %#p r%d n%d\n",
 		up?up->pid:0, s->cpath, s->ref, segtypename[s->type&SG_TYPE], s->base, addr,
 		(*pg)?(*pg)->pa:0, (*pg)?(*pg)->ref:0, (*pg)?(*pg)->n:-1);
@@ -228,8 +300,10 @@ fixfault(Segment *s, uintptr addr, int read, int dommuput)
 
 	case SG_TEXT:
 		/* Demand load */
-		pagein(s, addr, pg);	/* releases s->lk */
 		mmuflags = PTERONLY|PTEVALID;
+		if(around)
+			faultaround(s, addr, mmuflags);
+		pagein(s, addr, pg);	/* releases s->lk */
 		break;
 
 	case SG_SHARED:	
@@ -241,8 +315,10 @@ fixfault(Segment *s, uintptr addr, int read, int dommuput)
 			new->n = 1;
 			*pg = new;
 			qunlock(new);
-			qunlock(&s->lk);
 			mmuflags = PTEWRITE|PTEVALID;
+			if(around)
+				faultaround(s, addr, mmuflags);
+			qunlock(&s->lk);
 			break;
 		}
 		goto cow;
@@ -270,8 +346,10 @@ fixfault(Segment *s, uintptr addr, int read, int dommuput)
 			unlock(*pg);
 		if((*pg)->ref != 1 && (*pg)->n == 0)
 			panic("fixfault: cow: ref %d n %d", (*pg)->ref, (*pg)->n);
-		qunlock(&s->lk);
 		mmuflags = PTEWRITE | PTEVALID;
+		if(around)
+			faultaround(s, addr, mmuflags);
+		qunlock(&s->lk);
 		break;
 
 	case SG_PHYSICAL:
@@ -389,3 +467,70 @@ seg(Proc *p, uintptr addr, int dolock)
 
 	return 0;
 }
+
+/*
+ *  microbenchmark: fault in a new shared segment of n GiB,
+ *  one page after another, by writing to it.
+ *	faultbench n
+ */
+void
+faultbench(char *a, long n)
+{
+	Cmdbuf *cb;
+	Segment *s, *os;
+	int sno;
+	uintptr va, addr;
+	usize len;
+	ulong nf;
+	uvlong t0, ns;
+
+	cb = parsecmd(a, n);
+	if(waserror()){
+		free(cb);
+		nexterror();
+	}
+	if(cb->nf != 2)
+		error(Ebadctl);
+	len = strtoul(cb->f[1], 0, 0);
+	if(len == 0 || len > SEGMAXSIZE/GiB)
+		error(Ebadarg);
+	len *= GiB;
+	poperror();
+	free(cb);
+
+	qlock(&up->seglock);
+	if(waserror()){
+		qunlock(&up->seglock);
+		nexterror();
+	}
+	for(sno = 0; sno < NSEG; sno++)
+		if(up->seg[sno] == nil && sno != ESEG)
+			break;
+	if(sno == NSEG)
+		error("too many segments in process");
+	va = up->seg[SSEG]->base - len;
+	while((os = isoverlap(up, va, len)) != nil){
+		if(len > os->base)
+			error("cannot fit segment at virtual address");
+		va = os->base - len;
+	}
+	s = newseg(SG_SHARED, va, va+len, nil, PGSHFT);
+	up->seg[sno] = s;
+	qunlock(&up->seglock);
+	poperror();
+
+	t0 = fastticks(nil);
+	for(addr = va; addr < va+len; addr += PGSZ)
+		*(uchar*)UINT2PTR(addr) = 1;
+	ns = fastticks2ns(fastticks(nil) - t0);
+	nf = len/PGSZ;
+
+	qlock(&up->seglock);
+	up->seg[sno] = nil;
+	qunlock(&up->seglock);
+	putseg(s);
+	mmuflush();
+
+	print("faultbench: %lud faults: %llud ns, %llud ns/fault\n",
+		nf, ns, ns/nf);
+}
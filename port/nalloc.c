@@ -4,6 +4,79 @@
 #include	"dat.h"
 #include	"fns.h"
 
+/*
+ * Elements are kept in per-process (selfish) caches,
+ * then in per-mach magazines, and then in the Nalloc list.
+ * Magazines are used only by their mach, at splhi, and
+ * move NAMAG/2 elements at a time to/from the list.
+ */
+enum
+{
+	NAMAG = 32,
+};
+
+static Nlink*
+magget(Nalloc *na)
+{
+	Namag *mag;
+	Nlink *n;
+	Mpl s;
+	int i;
+
+	s = splhi();
+	mag = &na->mag[m->machno];
+	if(mag->first == nil){
+		lock(na);
+		for(i = 0; i < NAMAG/2 && (n = na->free) != nil; i++){
+			na->free = n->nnext;
+			n->nnext = mag->first;
+			mag->first = n;
+		}
+		mag->n += i;
+		na->nfree -= i;
+		na->nused += i;
+		unlock(na);
+	}
+	n = mag->first;
+	if(n != nil){
+		mag->first = n->nnext;
+		mag->n--;
+		mag->nallocs++;
+	}
+	splx(s);
+	return n;
+}
+
+static void
+magput(Nalloc *na, Nlink *n)
+{
+	Namag *mag;
+	Nlink *l, *t;
+	Mpl s;
+	int i;
+
+	s = splhi();
+	mag = &na->mag[m->machno];
+	if(mag->n >= NAMAG){
+		l = mag->first;
+		for(t = l, i = 1; i < NAMAG/2; i++)
+			t = t->nnext;
+		mag->first = t->nnext;
+		mag->n -= i;
+		lock(na);
+		t->nnext = na->free;
+		na->free = l;
+		na->nfree += i;
+		na->nused -= i;
+		unlock(na);
+	}
+	n->nnext = mag->first;
+	mag->first = n;
+	mag->n++;
+	mag->nfrees++;
+	splx(s);
+}
+
 void*
 nalloc(Nalloc *na)
 {
@@ -24,6 +97,8 @@ nalloc(Nalloc *na)
 			if(n != nil)
 				goto found;
 		}
+	if((n = magget(na)) != nil)
+		goto found;
 	lock(na);
 	n = na->free;
 	if(n != nil){
@@ -73,32 +148,38 @@ nfree(Nalloc *na, Nlink *n)
 		unlock(&up->selfishlk);
 		return;
 	}
-	lock(na);
-	n->nnext = na->free;
-	na->free = n;
-	na->nused--;
-	na->nfree++;
-	na->nfrees++;
-	unlock(na);
+	magput(na, n);
 }
 
 char*
 nasummary(char *s, char *e, void *a)
 {
 	Nalloc *na;
+	Namag *mag;
+	uint nmag, nmagallocs, nmagfrees;
 
 	na = a;
-	return seprint(s, e, "%ud/%ud %s %ud/%ud self allocs %ud/%ud self frees\n",
-		na->nused, na->nused+na->nfree, na->tag,
-		na->nselfallocs, na->nselfallocs+na->nallocs,
-		na->nselffrees, na->nselffrees+na->nfrees);
+	/* race; but stat only */
+	nmag = nmagallocs = nmagfrees = 0;
+	for(mag = na->mag; mag < &na->mag[MACHMAX]; mag++){
+		nmag += mag->n;
+		nmagallocs += mag->nallocs;
+		nmagfrees += mag->nfrees;
+	}
+	return seprint(s, e, "%ud/%ud %s %ud/%ud self allocs %ud/%ud self frees "
+		"%ud in mags %ud/%ud mag allocs %ud/%ud mag frees\n",
+		na->nused-nmag, na->nused+na->nfree, na->tag,
+		na->nselfallocs, na->nselfallocs+na->nallocs+nmagallocs,
+		na->nselffrees, na->nselffrees+na->nfrees+nmagfrees,
+		nmag, nmagallocs, nmagallocs+na->nallocs,
+		nmagfrees, nmagfrees+na->nfrees);
 }
 
 void
 nallocdump(void *x)
 {
 	Nlink *n;
-	char buf[128];
+	char buf[256];
 	Nalloc *na;
 
 	na = x;
@@ -488,6 +488,7 @@ static int
 openfile(Netif *nif, int id)
 {
 	Netfile *f, **fp, **efp;
+	char name[KNAMELEN+16];
 
 	if(id >= 0){
 		f = nif->f[id];
@@ -517,6 +518,8 @@ openfile(Netif *nif, int id)
 				free(f);
 				exhausted("memory");
 			}
+			snprint(name, sizeof name, "%s/%d/in", nif->name, (int)(fp - nif->f));
+			qsetname(f->iq, name);
 			*fp = f;
 			qlock(f);
 		} else {
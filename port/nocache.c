@@ -27,6 +27,12 @@ ceof(Chan*, vlong)
 	return -1;
 }
 
+int
+creclaim(void)
+{
+	return -1;
+}
+
 void
 cremove(Chan*)
 {
@@ -42,3 +48,45 @@ void
 cflushed(Chan*)
 {
 }
+
+long
+cattr(Chan*, uchar*, long)
+{
+	return 0;
+}
+
+void
+cattrput(Chan*, uchar*, long)
+{
+}
+
+void
+cattrqid(Chan*, Qid)
+{
+}
+
+void
+cattrinval(Chan*, Qid)
+{
+}
+
+int
+cnegwalk(Chan*, char*)
+{
+	return 0;
+}
+
+void
+cnegput(Chan*, Qid, char*)
+{
+}
+
+void
+cneginval(Chan*, char*)
+{
+}
+
+void
+cprefetched(Chan*, uchar*, long, long)
+{
+}
@@ -40,6 +40,20 @@
  * Without bundle allocators a 16K page split into 4K pages would
  * waste 1/4 of the memory to hold the Pgalloc for the inner 4K pages.
  *
+ * In front of the allocators there is a magazine per processor, page
+ * size and color: a small stack of free pages so that the common
+ * newpg/pgfree path does not take pgalk. Magazines are refilled from
+ * and drained to the allocators in batches of half a magazine.
+ * Pages kept in a magazine are accounted as used by their allocator
+ * and keep a ref of 1, so they are never joined while there.
+ *
+ * Memory pressure is handled by the pgreclaim process.
+ * There is a low and a high watermark per page size and color.
+ * When the pages available for a size (counting larger pages that
+ * could be split) fall below the low mark, cached segments are
+ * released (file cache first, then text cache) until we are above
+ * the high mark. Allocations that find no memory at all reclaim
+ * directly before failing.
  */
 
 enum
@@ -47,6 +61,7 @@ enum
 	NOTBUNDLED = 0xFF,
 
 	NPROCPOOLSZ = 10,	/* free pages kept on the proc for later */
+	NPGMAG = 16,		/* max pages per magazine */
 };
 
 /*
@@ -60,6 +75,27 @@ struct Pmem
 	int	color;
 };
 
+typedef struct Pgmag Pgmag;
+struct Pgmag
+{
+	Lock;
+	Page	*pg[NPGMAG];
+	int	n;
+	int	szi;
+	int	color;
+	long	nuser;		/* user pages taken less those put back */
+	ulong	nhits;		/* newpg served from the magazine */
+	ulong	nrefills;	/* batches taken from the allocators */
+	ulong	ndrains;	/* batches given back */
+};
+
+typedef struct Pgwm Pgwm;
+struct Pgwm
+{
+	usize	lo;		/* in pages; 0 if not watched */
+	usize	hi;
+};
+
 
 /*
  * Configured page sizes: 1G, 2M, 16k, 4k
@@ -72,10 +108,10 @@ struct Pmem
  * - The next to a bundle can't be a bundle.
  */
 static Pgasz	pgasz[] = {
-	{.pgszlg2 = 30, .atype = PGprealloc },
-	{.pgszlg2 = 21, .atype = PGprealloc },
-	{.pgszlg2 = 14, .atype = PGbundle },
-	{.pgszlg2 = 12, .atype = PGembed },
+	{.pgszlg2 = 30, .atype = PGprealloc, .nmag = 0 },
+	{.pgszlg2 = 21, .atype = PGprealloc, .nmag = 4 },
+	{.pgszlg2 = 14, .atype = PGbundle, .nmag = NPGMAG },
+	{.pgszlg2 = 12, .atype = PGembed, .nmag = NPGMAG },
 };
 static int npgasz = nelem(pgasz);
 static Lock pgalk;
@@ -91,12 +127,30 @@ static usize nfreepga, nfreepg, nusedpga, nusedpg;
 
 static int joinpages;	/* don't join pages split */
 static int nocolors;	/* ignore colors in alloc */
+static int nomags;	/* don't use per cpu magazines */
 static Pmem pmem[64];
+static Pgmag pgmag[MACHMAX][nelem(pgasz)][NCOLOR];
+static Pgwm pgwm[nelem(pgasz)][NCOLOR];
+static int pgwmlo = 10;	/* low watermark, per mille of memory */
+static int pgwmhi = 30;	/* high watermark, per mille of memory */
+
+static struct
+{
+	Rendez	r;
+	int	kicked;
+	int	nprocs;
+	ulong	nkicks;		/* reclaimer wakeups */
+	ulong	ndirect;	/* direct reclaims from newpg */
+	ulong	nsegs;		/* segments released */
+} pgrk;
 
 static int verb=1;	/* set to make DBG more verbose */
 static int testing;
 static int dontfree;	/* debug */
 
+static void	pgwminit(int);
+static int	pgmagflush(void);
+
 /*
  * Take the burden of dump the allocators sorted by address, it's easy
  * the check them out this way.
@@ -233,8 +287,12 @@ static char*
 pagesummary(char *s, char *e, void*)
 {
 	int i;
-	usize npg, nfree, nuser, nbundled, nsplit;
+	usize npg, nfree, nbundled, nsplit;
+	long nuser;
 	Pgalloc *pga;
+	Pgmag *mag;
+	ulong nmag, nhits, nrefills, ndrains;
+	int mi, ci;
 	char sz[30];
 
 	s = seprint(s, e, "%llud memory\n", sys->pmoccupied);
@@ -255,12 +313,28 @@ pagesummary(char *s, char *e, void*)
 			nsplit += pga->nsplit;
 		}
 		iunlock(&pgalk);
+		nmag = nhits = nrefills = ndrains = 0;
+		for(mi = 0; mi < MACHMAX; mi++)
+			for(ci = 0; ci < NCOLOR; ci++){
+				mag = &pgmag[mi][i][ci];
+				nmag += mag->n;
+				nuser += mag->nuser;
+				nhits += mag->nhits;
+				nrefills += mag->nrefills;
+				ndrains += mag->ndrains;
+			}
 		seprintsz(sz, sz + sizeof sz, pgasz[i].pgsz);
 		npg -= nbundled+nsplit;
 		s = seprint(s, e, "%lud/%lud %s pages", npg-nfree, npg, sz);
-		s = seprint(s, e, " %lud user %uld kernel %uld bundled %uld split\n",
+		s = seprint(s, e, " %ld user %uld kernel %uld bundled %uld split\n",
 			nuser, npg-nfree-nuser, nbundled, nsplit);
+		if(pgasz[i].nmag == 0)
+			continue;
+		s = seprint(s, e, "%lud %s pages in mags %lud hits %lud refills %lud drains\n",
+			nmag, sz, nhits, nrefills, ndrains);
 	}
+	s = seprint(s, e, "%lud reclaim kicks %lud direct %lud segs reclaimed\n",
+		pgrk.nkicks, pgrk.ndirect, pgrk.nsegs);
 	s = seprint(s, e, "%lud/%lud pgas\n", nusedpga, nusedpga+nfreepga);
 	s = seprint(s, e, "%lud/%lud pgs\n", nusedpg, nusedpg+nfreepg);
 	return s;
@@ -813,7 +887,7 @@ done:
 void
 pageinit(void)
 {
-	int e, i;
+	int e, i, mi, ci;
 	Pmem *pm;
 	usize minsz;
 	uintmem obase;
@@ -844,6 +918,14 @@ pageinit(void)
 		joinpages = atoi(s);
 	if((s=getconf("*nocolors")) != nil)
 		nocolors = atoi(s);
+	if((s=getconf("*nopgmags")) != nil)
+		nomags = atoi(s);
+	for(mi = 0; mi < MACHMAX; mi++)
+		for(i = 0; i < npgasz; i++)
+			for(ci = 0; ci < NCOLOR; ci++){
+				pgmag[mi][i][ci].szi = i;
+				pgmag[mi][i][ci].color = ci;
+			}
 	/*
 	 * We allocate structures in the first bank,
 	 * which makes its start unlikely to be aligned, which would require
@@ -864,6 +946,7 @@ pageinit(void)
 		nfreepga, nfreepg, nfreepga*sizeof(Pgalloc) + nfreepg*sizeof(Page));
 
 	pmem[0].base = obase;
+	pgwminit(e);
 	preallocpgas();
 	preallocpgs();
 	for(i = 0; i < e; i++)
@@ -879,16 +962,316 @@ pageinit(void)
 		testpga();
 }
 
+/*
+ * Watermarks are a fraction of the memory of each color,
+ * expressed in pages of each size.
+ * Pages split are not joined back unless joinpages, and reclaiming
+ * could not replenish larger sizes; only the smallest one has
+ * watermarks then.
+ */
+static void
+pgwminit(int nbanks)
+{
+	int i, c;
+	uvlong colorsz[NCOLOR];
+	char *s;
+
+	if((s=getconf("*pgwmlo")) != nil)
+		pgwmlo = atoi(s);
+	if((s=getconf("*pgwmhi")) != nil)
+		pgwmhi = atoi(s);
+	if(pgwmhi < pgwmlo)
+		pgwmhi = pgwmlo;
+	memset(colorsz, 0, sizeof colorsz);
+	for(i = 0; i < nbanks; i++)
+		if(pmem[i].color >= 0 && pmem[i].color < NCOLOR)
+			colorsz[pmem[i].color] += pmem[i].limit - pmem[i].base;
+	for(i = 0; i < npgasz; i++)
+		for(c = 0; c < NCOLOR; c++){
+			if(!joinpages && i != npgasz-1)
+				continue;
+			pgwm[i][c].lo = colorsz[c]/pgasz[i].pgsz * pgwmlo / 1000;
+			pgwm[i][c].hi = colorsz[c]/pgasz[i].pgsz * pgwmhi / 1000;
+		}
+}
+
+/*
+ * Pages of size index szi and the given color we could allocate,
+ * including those obtained by splitting larger free pages.
+ */
+static usize
+pgavail(int szi, int color)
+{
+	int i;
+	usize n;
+	Pgalloc *pga;
+
+	n = 0;
+	ilock(&pgalk);
+	for(i = 0; i <= szi; i++)
+		for(pga = pgasz[i].pga; pga != nil; pga = pga->next)
+			if(pga->color == color)
+				n += pga->nfree * (pgasz[i].pgsz/pgasz[szi].pgsz);
+	iunlock(&pgalk);
+	return n;
+}
+
+/*
+ * Return the size index for a size and color below its
+ * watermark, or -1.
+ */
 static int
-pgreclaim(usize sz)
+pgbelow(int hi, int *colorp, usize *availp)
 {
-	/*
-	 * TODO: reclaim segments to release pages.
-	 */
-	iprint("pgreclaim %uld\n", sz);
+	int i, c;
+	usize lim, n;
+
+	for(i = 0; i < npgasz; i++)
+		for(c = 0; c < NCOLOR; c++){
+			lim = hi ? pgwm[i][c].hi : pgwm[i][c].lo;
+			if(lim == 0)
+				continue;
+			n = pgavail(i, c);
+			if(n < lim){
+				*colorp = c;
+				*availp = n;
+				return i;
+			}
+		}
+	return -1;
+}
+
+/*
+ * Reclaiming releases segments, which qlocks and may sleep.
+ */
+static int
+pgcanreclaim(void)
+{
+	return up != nil && up->nlocks == 0 && islo();
+}
+
+/*
+ * Release one cached segment.
+ */
+static int
+pgreclaim(usize)
+{
+	if(creclaim() == 0 || segreclaim() == 0){
+		pgrk.nsegs++;
+		return 0;
+	}
+	return -1;
+}
+
+static int
+pgmustreclaim(void*)
+{
+	return pgrk.kicked;
+}
+
+/*
+ * Each pass releases a segment and the pages kept in magazines;
+ * stop when a pass frees nothing for the size below its mark.
+ */
+static void
+pgreclaimproc(void*)
+{
+	int i, c;
+	usize n;
+
+	for(;;){
+		if(!waserror()){
+			tsleep(&pgrk.r, pgmustreclaim, nil, 1000);
+			poperror();
+		}
+		pgrk.kicked = 0;
+		if(pgbelow(0, &c, &n) < 0)
+			continue;
+		DBG("pgreclaimproc: low on memory\n");
+		while((i = pgbelow(1, &c, &n)) >= 0){
+			pgreclaim(0);
+			pgmagflush();
+			if(pgavail(i, c) <= n)
+				break;
+		}
+	}
+}
+
+static void
+pgkick(void)
+{
+	if(pgrk.nprocs == 0){
+		if(pgcanreclaim() && ainc(&pgrk.nprocs) == 1)
+			kproc("pgreclaim", pgreclaimproc, nil);
+		return;
+	}
+	pgrk.nkicks++;
+	pgrk.kicked = 1;
+	wakeup(&pgrk.r);
+}
+
+static int
+pgszi(usize sz)
+{
+	int i;
+
+	for(i = 0; i < npgasz; i++)
+		if(pgasz[i].pgsz == sz)
+			return i;
 	return -1;
 }
 
+static Pgmag*
+pgmagof(int szi, int color)
+{
+	if(nomags || testing || szi < 0 || pgasz[szi].nmag == 0)
+		return nil;
+	if(color < 0)
+		color = m->color;
+	if(color < 0 || color >= NCOLOR)
+		return nil;
+	return &pgmag[m->machno][szi][color];
+}
+
+/*
+ * Give back pages taken from magazines.
+ * Pages that might be joined go through pgfree1, all others
+ * are released to their allocators with a single pgalk.
+ */
+static void pgfree1(Page*, int);
+
+static void
+pgmagdrain(Page **pgs, int n)
+{
+	int i;
+	Page *pg;
+	Pgalloc *pga;
+
+	ilock(&pgalk);
+	for(i = 0; i < n; i++){
+		pg = pgs[i];
+		pga = pg->pga;
+		if(joinpages && (pga->parent != nil || pga->bpga != nil))
+			continue;
+		pg->ref = 0;
+		pgafreepg(pga, pg);
+		pgs[i] = nil;
+	}
+	iunlock(&pgalk);
+	for(i = 0; i < n; i++)
+		if(pgs[i] != nil){
+			pgs[i]->ref = 0;
+			pgfree1(pgs[i], 0);
+		}
+}
+
+/* called with mag locked */
+static void
+pgmagrefill(Pgmag *mag)
+{
+	Pgalloc *pga;
+	Page *pg;
+	int want;
+
+	want = pgasz[mag->szi].nmag/2;
+	if(want == 0)
+		want = 1;
+	ilock(&pgalk);
+	for(pga = pgasz[mag->szi].pga; pga != nil && mag->n < want; pga = pga->next){
+		if(pga->color != mag->color)
+			continue;
+		while(mag->n < want && (pg = pganewpg(pga)) != nil)
+			mag->pg[mag->n++] = pg;
+	}
+	iunlock(&pgalk);
+	if(mag->n > 0)
+		mag->nrefills++;
+}
+
+static Page*
+pgmagget(usize sz, int color, int iskern)
+{
+	Pgmag *mag;
+	Page *pg;
+
+	if((mag = pgmagof(pgszi(sz), color)) == nil)
+		return nil;
+	pg = nil;
+	ilock(mag);
+	if(mag->n == 0)
+		pgmagrefill(mag);
+	if(mag->n > 0){
+		pg = mag->pg[--mag->n];
+		mag->pg[mag->n] = nil;
+		mag->nhits++;
+		if(!iskern)
+			mag->nuser++;
+	}
+	iunlock(mag);
+	return pg;
+}
+
+static int
+pgmagput(Page *pg)
+{
+	Pgmag *mag;
+	Page *pgs[NPGMAG];
+	int n, nmag;
+
+	if((mag = pgmagof(pg->pga->szi, pg->pga->color)) == nil)
+		return 0;
+	nmag = pgasz[mag->szi].nmag;
+	pg->ref = 1;
+	n = 0;
+	ilock(mag);
+	if(pg->va != 0)
+		mag->nuser--;
+	pg->va = 0;
+	if(mag->n == nmag){
+		n = nmag - nmag/2;
+		mag->n -= n;
+		memmove(pgs, &mag->pg[mag->n], n*sizeof pgs[0]);
+		mag->ndrains++;
+	}
+	mag->pg[mag->n++] = pg;
+	iunlock(mag);
+	if(n > 0)
+		pgmagdrain(pgs, n);
+	return 1;
+}
+
+/*
+ * Release all pages held in magazines, for all processors.
+ * Used before declaring that we are out of memory.
+ */
+static int
+pgmagflush(void)
+{
+	int mi, i, ci, n, tot;
+	Pgmag *mag;
+	Page *pgs[NPGMAG];
+
+	tot = 0;
+	for(mi = 0; mi < MACHMAX; mi++)
+		for(i = 0; i < npgasz; i++)
+			for(ci = 0; ci < NCOLOR; ci++){
+				mag = &pgmag[mi][i][ci];
+				if(mag->n == 0)
+					continue;
+				ilock(mag);
+				n = mag->n;
+				memmove(pgs, mag->pg, n*sizeof pgs[0]);
+				mag->n = 0;
+				if(n > 0)
+					mag->ndrains++;
+				iunlock(mag);
+				if(n > 0)
+					pgmagdrain(pgs, n);
+				tot += n;
+			}
+	return tot;
+}
+
 static Page*
 splitbundle(Page *pg)
 {
@@ -928,7 +1311,13 @@ newpg(usize sz, int color, int iskern)
 	Pgalloc *pga, *ppga;
 	Page *pg;
 	usize pgsz;
+	int flushed;
+
+	if((pg = pgmagget(sz, color, iskern)) != nil)
+		goto checked;
 
+	flushed = 0;
+again:
 	/* Find the smallest page already available */
 	for(i = npgasz-1; i >= 0; i--){
 		if(pgasz[i].pgsz < sz)
@@ -952,6 +1341,21 @@ newpg(usize sz, int color, int iskern)
 		iunlock(&pgalk);
 	}
 	DBG("newpg: no pages: sz %uld\n", sz);
+
+	/*
+	 * If any color will do, release pages kept in magazines
+	 * and then cached segments before failing.
+	 */
+	if(color >= 0)
+		return nil;
+	if(!flushed++ && pgmagflush() > 0)
+		goto again;
+	if(pgcanreclaim()){
+		pgrk.ndirect++;
+		pgkick();
+		if(pgreclaim(sz) == 0)
+			goto again;
+	}
 	return nil;
 found:
 	/*
@@ -993,7 +1397,10 @@ found:
 		pg->pga->nuser++;
 		iunlock(&pgalk);
 	}
-	if(i == npgasz || pgasz[i].pgsz != sz || (1<<pg->pgszlg2) != sz)
+	if(i == npgasz || pgasz[i].pgsz != sz)
+		panic("newpg: sizes");
+checked:
+	if((1<<pg->pgszlg2) != sz)
 		panic("newpg: sizes");
 	if(pg->pa < pg->pga->start || pg->pa+sz > pg->pga->start+pg->pga->npg*sz)
 		panic("newpg: %#P off limits", pg->pa);
@@ -1034,17 +1441,19 @@ newpage(uint pgsz, int color, int clear, uintptr va)
 		}
 	}
 	/*
-	 * Try first with the desired color, then with any color,
-	 * and finally with any color after reclaiming memory.
+	 * Try first with the desired color, then with any color.
+	 * The later reclaims memory if there is none.
+	 * Wake up the reclaimer if the color had no pages.
 	 */
 	if(nocolors)
 		color = -1;
+	if(pgrk.nprocs == 0)
+		pgkick();
 	pg = newpg(pgsz, color, va == 0);
-	if(pg == nil && color >= 0)
-		pg = newpg(pgsz, -1, va == 0);
-
-	while(pg == nil && pgreclaim(pgsz) == 0)
+	if(pg == nil && color >= 0){
+		pgkick();
 		pg = newpg(pgsz, -1, va == 0);
+	}
 	if(pg == nil)
 		panic("no free pages");
 	if(verb)DBG("newpage %#p -> %#p src %#p\n",
@@ -1108,7 +1517,7 @@ joinbundle(Page *pg)
 }
 
 static void
-pgfree(Page *pg)
+pgfree1(Page *pg, int usemag)
 {
 	Pgalloc *pga;
 	Page *ppg;
@@ -1124,6 +1533,8 @@ pgfree(Page *pg)
 		return;
 
 	pg->n = 0;
+	if(usemag && pgmagput(pg))
+		return;
 	pga = pg->pga;
 	szi = pga->szi;
 	pgsz = pgasz[szi].pgsz;
@@ -1213,6 +1624,12 @@ pgfree(Page *pg)
 	pgfree(ppg);
 }
 
+static void
+pgfree(Page *pg)
+{
+	pgfree1(pg, 1);
+}
+
 void
 putpage(Page *pg)
 {
@@ -20,7 +20,9 @@ typedef struct Mount	Mount;
 typedef struct Mounted	Mounted;
 typedef struct Mnt	Mnt;
 typedef struct Mntrpc	Mntrpc;
+typedef struct Mntstats	Mntstats;
 typedef struct Nalloc	Nalloc;
+typedef struct Namag	Namag;
 typedef struct Name	Name;
 typedef struct Namec	Namec;
 typedef struct Nlink	Nlink;
@@ -111,6 +113,17 @@ struct Nlink
 	Nlink	*nlist;
 };
 
+/*
+ * Per-mach cache for a Nalloc
+ */
+struct Namag
+{
+	Nlink	*first;
+	uint	n;
+	uint	nallocs;
+	uint	nfrees;
+};
+
 struct Nalloc
 {
 	char	*tag;
@@ -130,6 +143,7 @@ struct Nalloc
 	uint	nfrees;
 	uint	nselfallocs;
 	uint	nselffrees;
+	Namag	mag[MACHMAX];
 };
 
 /*
@@ -178,6 +192,7 @@ enum
 	Budpck	=	(1<<3),		/* udp checksum */
 	Btcpck	=	(1<<4),		/* tcp checksum */
 	Bpktck	=	(1<<5),		/* packet checksum */
+	BEXT	=	(1<<6),		/* data kept elsewhere; see extblock */
 
 };
 
@@ -191,6 +206,8 @@ struct Block
 	uchar*	lim;			/* 1 past the end of the buffer */
 	uchar*	base;			/* start of the buffer */
 	void	(*free)(Block*);
+	Page*	pg;			/* page holding the data (BEXT) */
+	void*	aux;			/* argument for free (BEXT) */
 	ushort	flag;
 	ushort	checksum;		/* IP checksum of complete packet (minus media header) */
 };
@@ -209,14 +226,18 @@ struct Mntrpc
 	Chan*	c;		/* Channel for whom we are working */
 	Mntrpc*	next;		/* in free or pending list */
 	Mntrpc*	prev;		/* in pending list */
+	Mntrpc*	hnext;		/* in Mnt tag hash */
+	Mntrpc*	hprev;
 	Fcall	request;	/* Outgoing file system protocol message */
 	Fcall 	reply;		/* Incoming reply */
 	Mnt*	m;		/* Mount device during rpc */
 	Rendez	r;		/* Place to hang out */
 	uchar*	rpc;		/* I/O Data buffer */
 	uint	rpclen;		/* len of buffer */
+	uchar*	srpc;		/* own buffer while rpc is a large one */
 	Block	*b;		/* reply blocks */
 	char	done;		/* Rpc completed */
+	char	kdata;		/* Rread data goes to request.data on arrival */
 	uvlong	stime;		/* start time for mnt statistics */
 	ulong	reqlen;		/* request length for mnt statistics */
 	ulong	replen;		/* reply length for mnt statistics */
@@ -272,6 +293,13 @@ struct Chanflds
 	int	hasmtpt;		/* has mount points under it */
 	Lock	mclock;
 	Segment	*mc;			/* Mount cache pointer */
+	QLock	wblk;			/* write-behind (cache.c) */
+	Mntrpc*	wb;			/* Twrites not yet waited for */
+	Mntrpc*	wbtl;
+	long	nwb;			/* bytes written in wb */
+	vlong	rdoff;			/* next offset if reading sequentially */
+	vlong	raend;			/* read ahead queued up to here */
+	long	rawin;			/* read ahead window; 0 if random */
 	Mnt*	mux;			/* Mnt for clients using me for messages */
 	union {
 		void*	aux;
@@ -376,6 +404,13 @@ struct Mount
 #pragma varargck type "T" Mount*
 #pragma varargck type ">" int
 
+enum
+{
+	TAGLOG	=	6,
+	TAGHASH =	1<<TAGLOG,	/* Hash to match replies to rpcs */
+};
+#define TAGH(t)	((t)&((1<<TAGLOG)-1))
+
 
 struct Mnt
 {
@@ -385,12 +420,23 @@ struct Mnt
 	Proc	*rip;		/* Reader in progress */
 	Mntrpc	*queuehd;	/* Queue of pending requests on this channel */
 	Mntrpc	*queuetl;
+	Mntrpc	*taghd[TAGHASH];	/* pending requests by tag, in order sent */
+	Mntrpc	*tagtl[TAGHASH];
 	uint	id;		/* Multiplexer id for channel check */
 	Mnt	*list;		/* Free or in use lists */
 	int	msize;		/* data + IOHDRSZ */
 	char	*version;	/* 9P version */
 	int	sharedtags;	/* Ok to share tags in this version? */
 	Queue	*q;		/* input queue */
+	QLock	wlk;		/* serializes large writes to c */
+	int	muxproc;	/* replies demuxed by mproc (*mntproc) */
+	Proc	*mproc;		/* demultiplexer kproc */
+	Rendez	mr;		/* mproc waits for requests */
+	Rendez	cr;		/* muxclose waits for mproc to exit */
+	int	closing;	/* muxclose is waiting */
+	int	hungup;		/* mproc is gone; no more rpcs */
+	int	nqueued;	/* rpcs pending */
+	Mntstats	*stats;	/* see mntstatsread */
 };
 
 enum
@@ -440,6 +486,7 @@ struct Pgasz
 	usize	pgsz;		/* page size */
 	uchar	pgszlg2;	/* log2 pgsz */
 	uchar	atype;		/* allocation type */
+	uchar	nmag;		/* pages per cpu magazine; 0 if none */
 	Pgalloc *pga;		/* allocator list */
 	Pgalloc *last;		/* last in allocator list */
 	Rendez	r;		/* Sleep for free mem */
@@ -1162,7 +1209,7 @@ struct Watchdog
 	void	(*stat)(char*, char*);	/* watchdog statistics */
 };
 
-/* queue state bits,  Qmsg, Qcoalesce, and Qkick can be set in qopen */
+/* queue state bits,  Qmsg, Qcoalesce, Qkick, and Qspsc can be set in qopen */
 enum
 {
 	/* Queue.state */
@@ -1172,6 +1219,7 @@ enum
 	Qflow		= (1<<3),	/* producer flow controlled */
 	Qcoalesce	= (1<<4),	/* coalesce packets on read */
 	Qkick		= (1<<5),	/* always call the kick routine after qwrite */
+	Qspsc		= (1<<6),	/* single producer and consumer, lock free */
 };
 
 #define DEVDOTDOT -1
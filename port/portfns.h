@@ -18,6 +18,10 @@ Block*		bl2mem(uchar*, Block*, int);
 int		blocklen(Block*);
 void		bootlinks(void);
 void		callwithureg(void (*)(Ureg*));
+long		cattr(Chan*, uchar*, long);
+void		cattrinval(Chan*, Qid);
+void		cattrput(Chan*, uchar*, long);
+void		cattrqid(Chan*, Qid);
 int		canlock(Lock*);
 int		canpage(Proc*);
 int		canqlock(QLock*);
@@ -37,15 +41,20 @@ void		closepgrp(Pgrp*);
 void		closergrp(Rgrp*);
 void		cmderror(Cmdbuf*, char*);
 int		cmount(Chan**, Chan*, int);
+void		cneginval(Chan*, char*);
+void		cnegput(Chan*, Qid, char*);
+int		cnegwalk(Chan*, char*);
 int		consactive(void);
 void		(*consdebug)(void);
 Block*		concatblock(Block*);
 void		(*consputs)(char*, int);
 void		copen(Chan*);
+void		cprefetched(Chan*, uchar*, long, long);
 Block*		copyblock(Block*, int);
 void		pagecpy(Page*, Page*);
 void		clearseg(Segment*);
 long		cread(Chan*, uchar*, long, vlong);
+int		creclaim(void);
 void		cremove(Chan*);
 void		cunmount(Chan*, Chan*);
 void		cupdate(Chan*, uchar*, int, vlong);
@@ -106,6 +115,9 @@ uvlong		fastticks(uvlong*);
 uvlong		fastticks2us(uvlong);
 uvlong		fastticks2ns(uvlong);
 int		fault(uintptr, int);
+void		faultbench(char*, long);
+void		faultinit(void);
+Block*		extblock(uchar*, int, Page*, void (*)(Block*), void*);
 void		fdclose(int, int);
 Chan*		fdtochan(int, int, int, int);
 int		fixfault(Segment*, uintptr, int, int);
@@ -163,6 +175,8 @@ Cmdtab*		lookupcmd(Cmdbuf*, Cmdtab*, int);
 Page*		lookpage(Segment*, uintptr);
 #define		MS2NS(n) (((vlong)(n))*1000000LL)
 void		mallocinit(void);
+void		heapprofctl(char*, long);
+long		heapprofread(void*, long, vlong);
 Block*		mem2bl(uchar*, int);
 void		mfreeseg(Segment*, uintptr, uintptr);
 void		microdelay(int);
@@ -171,13 +185,16 @@ void		mkqid(Qid*, vlong, ulong, int);
 void		mmuflush(void);
 void		mmuput(Proc*, Page*, uint);
 void		mmurelease(Proc*);
+void		mmushootdown(Mach*, uintptr, uintptr);
 void		mmuswitch(void);
 Chan*		mntauth(Chan*, char*);
+void		mntbench(char*, long);
 void		mntclose(Mount*);
 void		mntdump(Mount*, int);
 Chan*		mntlookup(Path*, int, int);
 void		mntmount(Mount*, Path*, Chan*, int);
 void		mntunmount(Mount*, Path*, Chan*);
+long		mntstatsread(void*, long, vlong);
 usize		mntversion(Chan*, u32int, char*, usize);
 int		mregfmt(Fmt*);
 ulong		ms2tk(ulong);
@@ -206,6 +223,7 @@ int		okaddr(uintptr, long, int);
 int		openmode(int);
 Block*		packblock(Block*);
 Block*		padblock(Block*, int);
+Block*		pageblock(Page*, int, int);
 void		pageinit(void);
 void		pagememinit(uintmem, uintmem);
 ulong		pagenumber(Page*);
@@ -218,6 +236,7 @@ ulong		perfticks(void);
 void		pexit(char*, int);
 void		pgrpcpy(Pgrp*, Pgrp*);
 void		pgrpnote(ulong, char*, long, int);
+Block*		pipebreadlist(Chan*, long);
 void		prefaultseg(Segment *s);
 int		psindex(int);
 #define		poperror()		up->nerrlab--
@@ -231,7 +250,7 @@ void		psinit(void);
 ulong		procalarm(ulong);
 void		procctl(Proc*);
 int		procfdprint(Chan*, int, int, char*, int);
-void		procflushseg(Segment*);
+void		procflushseg(Segment*, uintptr, uintptr);
 void		procpriority(Proc*, int, int);
 void		procrestore(Proc*);
 void		procsave(Proc*);
@@ -249,7 +268,9 @@ void		putseg(Segment*);
 void		putstrn(char*, int);
 int		pwait(Waitmsg*);
 void		qaddlist(Queue*, Block*);
+void		qbench(char*, long);
 Block*		qbread(Queue*, int);
+Block*		qbreadlist(Queue*, int);
 long		qbwrite(Queue*, Block*);
 Queue*		qbypass(void (*)(void*, Block*), void*);
 int		qcanread(Queue*);
@@ -268,6 +289,7 @@ int		qlen(Queue*);
 void		qlock(QLock*);
 Queue*		qopen(int, int, void (*)(void*), void*);
 int		qpass(Queue*, Block*);
+int		qpasslist(Queue*, Block*);
 int		qpassnolim(Queue*, Block*);
 int		qproduce(Queue*, void*, int);
 void		qputback(Queue*, Block*);
@@ -275,6 +297,8 @@ long		qread(Queue*, void*, int);
 Block*		qremove(Queue*);
 void		qreopen(Queue*);
 void		qsetlimit(Queue*, int);
+void		qsetname(Queue*, char*);
+long		qstatsread(void*, long, vlong);
 void		qunlock(QLock*);
 int		qwindow(Queue*);
 int		qwrite(Queue*, void*, int);
@@ -312,6 +336,7 @@ void		setsched(void);
 Mount*		setslash(Mount*, Chan*);
 void		sleep(Rendez*, int (*)(void*), void*);
 void*		smalloc(ulong);
+Block*		splitblock(Block*, int);
 char*		srvname(Chan*);
 void		syscallfmt(int, va_list list);
 void		sysretfmt(int, va_list, Ar0*, uvlong, uvlong);
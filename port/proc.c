@@ -1241,11 +1241,12 @@ dumpaproc(Proc *p)
 }
 
 /*
- *  wait till all processes have flushed their mmu
- *  state about segement s
+ *  make all processes using s drop their mmu state
+ *  for [va, top). Processors running them are sent
+ *  a shootdown and we wait for them to complete it.
  */
 void
-procflushseg(Segment *s)
+procflushseg(Segment *s, uintptr va, uintptr top)
 {
 	int i, ns, nm, nwait;
 	Proc *p;
@@ -1268,7 +1269,7 @@ procflushseg(Segment *s)
 					if((mp = sys->machptr[nm]) == nil || !mp->online)
 						continue;
 					if(mp->proc == p){
-						mp->mmuflush = 1;
+						mmushootdown(mp, va, top);
 						nwait++;
 					}
 				}
@@ -1282,14 +1283,18 @@ procflushseg(Segment *s)
 		return;
 
 	/*
-	 *  wait for all processors to take a clock interrupt
-	 *  and flush their mmu's
+	 *  wait for all processors to take the shootdown
+	 *  and flush their mmu's. They may have interrupts
+	 *  disabled for a while; the clock also flushes.
 	 */
 	for(i = 0; i < MACHMAX; i++){
 		if((mp = sys->machptr[i]) == nil || !mp->online || mp == m)
 			continue;
-		while(mp->mmuflush)
-			sched();
+		for(nm = 0; mp->mmuflush; nm++)
+			if(nm > 1000)
+				sched();
+			else
+				microdelay(1);
 	}
 }
 
@@ -9,9 +9,11 @@ static ulong padblockcnt;
 static ulong concatblockcnt;
 static ulong pullupblockcnt;
 static ulong copyblockcnt;
+static ulong splitblockcnt;
 static ulong consumecnt;
 static ulong producecnt;
 static ulong qcopycnt;
+ulong noblockcnt;
 
 static int debugging;
 
@@ -21,6 +23,7 @@ static int debugging;
  *  IO queues
  */
 typedef struct Queue	Queue;
+typedef struct Qstats	Qstats;
 
 struct Queue
 {
@@ -46,12 +49,58 @@ struct Queue
 	QLock	wlock;		/* mutex for writing processes */
 	Rendez	wr;		/* process waiting to write */
 
+	/* Qspsc */
+	Block**	ring;		/* block lists queued */
+	uint	nring;		/* # of entries in ring, a power of 2 */
+	uint	rtail;		/* next ring entry written (producer) */
+	uint	rhead;		/* next ring entry read (consumer) */
+	Block*	rfirst;		/* rest of the list being read (consumer) */
+	ulong	nin;		/* bytes allocated, queued (producer) */
+	ulong	ndin;		/* data bytes queued (producer) */
+	ulong	nout;		/* bytes allocated, dequeued (consumer) */
+	ulong	ndout;		/* data bytes dequeued (consumer) */
+	int	rwait;		/* consumer sleeping on rr (consumer) */
+	int	wwait;		/* producer sleeping on wr (producer) */
+
+	Qstats*	st;		/* statistics, for named queues */
+
 	char	err[ERRMAX];
 };
 
+/*
+ *  statistics for queues with a name (see qsetname).
+ *  updated with the queue ilocked, but for the times
+ *  writers wait, which are updated holding wlock.
+ */
+struct Qstats
+{
+	Qstats*	next;		/* in qnames */
+	Queue*	q;
+	char	name[64];
+	uvlong	bin;		/* data bytes in */
+	uvlong	bout;		/* data bytes out */
+	ulong	nbin;		/* blocks in */
+	ulong	nbout;		/* blocks out */
+	int	dlen;		/* q->dlen at last */
+	int	maxlen;		/* high-water mark of dlen */
+	uvlong	last;		/* fastticks of last update */
+	uvlong	area;		/* sum of dlen*µs, for the time queued */
+	ulong	nrwait;		/* # of times readers waited */
+	uvlong	rwait;		/* µs readers waited */
+	ulong	nwwait;		/* # of times writers waited */
+	uvlong	wwait;		/* µs writers waited */
+};
+
+static struct
+{
+	Lock;
+	Qstats*	first;
+} qnames;
+
 enum
 {
 	Maxatomic	= 64*1024,
+	Nspsc		= 1024,		/* ring entries for Qspsc queues */
 };
 
 uint	qiomaxatomic = Maxatomic;
@@ -64,12 +113,481 @@ ixdumpsummary(void)
 	debugging ^= 1;
 	iallocsummary(buf, buf+sizeof buf, nil);
 	print("%s", buf);
-	print("pad %lud, concat %lud, pullup %lud, copy %lud\n",
-		padblockcnt, concatblockcnt, pullupblockcnt, copyblockcnt);
+	print("pad %lud, concat %lud, pullup %lud, copy %lud, split %lud\n",
+		padblockcnt, concatblockcnt, pullupblockcnt, copyblockcnt,
+		splitblockcnt);
 	print("consume %lud, produce %lud, qcopy %lud\n",
 		consumecnt, producecnt, qcopycnt);
 }
 
+/*
+ *  account for a change in q->dlen.
+ *  called with q ilocked.
+ */
+static void
+qstupdate(Qstats *st, int dlen)
+{
+	uvlong now, us;
+
+	now = fastticks(nil);
+	us = fastticks2us(now - st->last);
+	if(us > 0){
+		st->area += (uvlong)st->dlen * us;
+		st->last = now;
+	}
+	st->dlen = dlen;
+	if(dlen > st->maxlen)
+		st->maxlen = dlen;
+}
+
+static void
+qstin(Queue *q, int nb, int n)
+{
+	Qstats *st;
+
+	st = q->st;
+	if(st == nil)
+		return;
+	st->nbin += nb;
+	st->bin += n;
+	qstupdate(st, q->dlen);
+}
+
+static void
+qstout(Queue *q, int nb, int n)
+{
+	Qstats *st;
+
+	st = q->st;
+	if(st == nil)
+		return;
+	st->nbout += nb;
+	st->bout += n;
+	qstupdate(st, q->dlen);
+}
+
+/*
+ *  name a queue and keep statistics for it,
+ *  listed by qstatsread.
+ */
+void
+qsetname(Queue *q, char *name)
+{
+	Qstats *st;
+
+	st = q->st;
+	if(st == nil){
+		st = mallocz(sizeof *st, 1);
+		if(st == nil)
+			return;
+		st->q = q;
+		st->last = fastticks(nil);
+		lock(&qnames);
+		st->next = qnames.first;
+		qnames.first = st;
+		unlock(&qnames);
+	}
+	strecpy(st->name, st->name+sizeof st->name, name);
+	q->st = st;
+}
+
+static void
+qunname(Queue *q)
+{
+	Qstats **l, *st;
+
+	st = q->st;
+	if(st == nil)
+		return;
+	lock(&qnames);
+	for(l = &qnames.first; *l != nil; l = &(*l)->next)
+		if(*l == st){
+			*l = st->next;
+			break;
+		}
+	unlock(&qnames);
+	q->st = nil;
+	free(st);
+}
+
+/*
+ *  One line per named queue:
+ *	name len limit state bin bout nbin nbout maxlen queued nrwait rwait nwwait wwait
+ *  queued is the mean time (µs) bytes stay queued; rwait and wwait are µs.
+ *  Qspsc queues report only their lengths and byte counts.
+ */
+long
+qstatsread(void *a, long n, vlong offset)
+{
+	char *buf, *p, *e;
+	Qstats *st;
+	Queue *q;
+	uvlong bin, bout, queued;
+	int nq;
+
+	nq = 0;
+	lock(&qnames);
+	for(st = qnames.first; st != nil; st = st->next)
+		nq++;
+	unlock(&qnames);
+	p = buf = smalloc(nq*200 + 1);
+	e = buf + nq*200 + 1;
+	lock(&qnames);
+	for(st = qnames.first; st != nil && p < e; st = st->next){
+		q = st->q;
+		if(q->state & Qspsc){
+			bin = q->ndin;
+			bout = q->ndout;
+		}else{
+			bin = st->bin;
+			bout = st->bout;
+		}
+		queued = 0;
+		if(bout > 0)
+			queued = st->area / bout;
+		p = seprint(p, e, "%s %d %d %#ux %llud %llud %lud %lud %d %llud %lud %llud %lud %llud\n",
+			st->name, qlen(q), q->limit, q->state, bin, bout,
+			st->nbin, st->nbout, st->maxlen, queued,
+			st->nrwait, st->rwait, st->nwwait, st->wwait);
+	}
+	unlock(&qnames);
+	n = readstr(offset, a, n, buf);
+	free(buf);
+	return n;
+}
+
+/*
+ *  Qspsc queues have a single producer and a single consumer,
+ *  which share a ring of block lists without taking the queue lock.
+ *  Each ring index and counter is written only by one side,
+ *  as noted in Queue.  A side sets its wait flag before sleeping,
+ *  and the other side issues a wakeup only if it sees the flag set,
+ *  so there are no wakeups while both sides are running.
+ *  Producers are restarted only once the queue drains below half
+ *  its limit, as in the locked queues.
+ *
+ *  Only qbwrite, qwrite, qpass and qpassnolim may be used by the
+ *  producer and qbread, qread and qget by the consumer.
+ */
+
+static void
+nospsc(Queue *q, char *fn)
+{
+	if(q->state & Qspsc)
+		panic("%s: Qspsc queue", fn);
+}
+
+static int
+spsclen(Queue *q)
+{
+	return q->nin - q->nout;
+}
+
+static int
+spscnotempty(void *a)
+{
+	Queue *q = a;
+
+	return (q->state & Qclosed) || q->rfirst != nil || q->rhead != q->rtail;
+}
+
+static int
+spscnotfull(void *a)
+{
+	Queue *q = a;
+
+	if(q->state & Qclosed)
+		return 1;
+	return spsclen(q) < q->limit && q->rtail - q->rhead < q->nring;
+}
+
+/*
+ *  producer: queue the list b.
+ *  return -1 if the ring is full or the bytes queued.
+ */
+static int
+spscput(Queue *q, Block *b, int *woke)
+{
+	int len, dlen;
+	Block *l;
+
+	*woke = 0;
+	if(q->rtail - q->rhead >= q->nring)
+		return -1;
+	len = dlen = 0;
+	for(l = b; l != nil; l = l->next){
+		QDEBUG checkb(l, "spscput");
+		len += BALLOC(l);
+		dlen += BLEN(l);
+	}
+	q->ring[q->rtail & (q->nring-1)] = b;
+	q->nin += len;
+	q->ndin += dlen;
+	coherence();
+	q->rtail++;
+	coherence();
+	if(q->rwait){
+		wakeup(&q->rr);
+		*woke = 1;
+	}
+	return len;
+}
+
+/*
+ *  producer: wait for room in the queue.
+ */
+static void
+spscwwait(Queue *q)
+{
+	q->wwait = 1;
+	coherence();
+	if(waserror()){
+		q->wwait = 0;
+		nexterror();
+	}
+	sleep(&q->wr, spscnotfull, q);
+	poperror();
+	q->wwait = 0;
+}
+
+/*
+ *  consumer: next block, left in q->rfirst.
+ */
+static Block*
+spscpeek(Queue *q)
+{
+	if(q->rfirst == nil && q->rhead != q->rtail){
+		q->rfirst = q->ring[q->rhead & (q->nring-1)];
+		q->ring[q->rhead & (q->nring-1)] = nil;
+		coherence();
+		q->rhead++;
+	}
+	return q->rfirst;
+}
+
+/*
+ *  consumer: remove the next block.
+ */
+static Block*
+spscget(Queue *q)
+{
+	Block *b;
+
+	b = spscpeek(q);
+	if(b == nil)
+		return nil;
+	q->rfirst = b->next;
+	b->next = nil;
+	q->nout += BALLOC(b);
+	q->ndout += BLEN(b);
+	return b;
+}
+
+/*
+ *  consumer: put a block back to the front.
+ */
+static void
+spscputback(Queue *q, Block *b)
+{
+	b->next = q->rfirst;
+	q->rfirst = b;
+	q->nout -= BALLOC(b);
+	q->ndout -= BLEN(b);
+}
+
+/*
+ *  consumer: restart the producer if it waits and
+ *  the queue is below half its limit.
+ */
+static void
+spscrestart(Queue *q)
+{
+	coherence();
+	if(q->wwait == 0)
+		return;
+	if(spsclen(q) >= q->limit/2 || q->rtail - q->rhead >= q->nring)
+		return;
+	if(q->kick)
+		q->kick(q->arg);
+	wakeup(&q->wr);
+}
+
+/*
+ *  consumer: wait for the queue to be non-empty or closed.
+ *  same return values of qwait.
+ */
+static int
+spscwait(Queue *q)
+{
+	for(;;){
+		if(spscpeek(q) != nil)
+			return 1;
+		if(q->state & Qclosed){
+			if(++q->eof > 3)
+				return -1;
+			if(*q->err && strcmp(q->err, Ehungup) != 0)
+				return -1;
+			return 0;
+		}
+		q->rwait = 1;
+		coherence();
+		if(waserror()){
+			q->rwait = 0;
+			nexterror();
+		}
+		sleep(&q->rr, spscnotempty, q);
+		poperror();
+		q->rwait = 0;
+	}
+}
+
+/*
+ *  free all queued blocks.
+ *  only when neither side may be using the queue.
+ */
+static void
+spscdrain(Queue *q)
+{
+	Block *b;
+
+	while((b = spscget(q)) != nil)
+		freeb(b);
+}
+
+static int
+spscpass(Queue *q, Block *b, int nolim)
+{
+	int len, woke;
+
+	if(q->state & Qclosed){
+		len = BALLOC(b);
+		freeblist(b);
+		return len;
+	}
+	if(!nolim && spsclen(q) >= q->limit){
+		freeblist(b);
+		return -1;
+	}
+	len = spscput(q, b, &woke);
+	if(len < 0)
+		freeblist(b);
+	return len;
+}
+
+static long
+spscbwrite(Queue *q, Block *b)
+{
+	int n, woke, empty;
+
+	n = blocklen(b);
+	if(waserror()){
+		freeblist(b);
+		nexterror();
+	}
+	if(b->next != nil && (q->state&Qmsg) != 0)
+		b = concatblock(b);
+	for(;;){
+		if(q->state & Qclosed)
+			error(q->err);
+		if(q->noblock && spsclen(q) >= q->limit){
+			freeblist(b);
+			noblockcnt += n;
+			poperror();
+			return n;
+		}
+		/* racy, but the consumer only makes it empty */
+		empty = q->rtail == q->rhead && q->rfirst == nil;
+		if(spscput(q, b, &woke) >= 0)
+			break;
+		spscwwait(q);
+	}
+	poperror();
+
+	/*  get output going again, as qbwrite does when not empty */
+	if(q->kick && (woke || empty || (q->state&Qkick)))
+		q->kick(q->arg);
+
+	/* flow control, see qbwrite */
+	while(!q->noblock && !spscnotfull(q))
+		spscwwait(q);
+	return n;
+}
+
+static Block*
+spscbread(Queue *q, int len)
+{
+	Block *b;
+
+	switch(spscwait(q)){
+	case 0:
+		/* queue closed */
+		return nil;
+	case -1:
+		/* multiple reads on a closed queue */
+		error(q->err);
+	}
+
+	b = spscget(q);
+	if(BLEN(b) > len){
+		if((q->state&Qmsg) == 0)
+			spscputback(q, splitblock(b, len));
+		b->wp = b->rp + len;
+	}
+
+	/* restart producer */
+	spscrestart(q);
+	return b;
+}
+
+static long
+spscread(Queue *q, void *vp, int len)
+{
+	Block *b, *first, **l;
+	int n;
+
+again:
+	switch(spscwait(q)){
+	case 0:
+		/* queue closed */
+		return 0;
+	case -1:
+		/* multiple reads on a closed queue */
+		error(q->err);
+	}
+
+	first = spscget(q);
+	n = BLEN(first);
+	if(q->state & Qcoalesce){
+		/* when coalescing, 0 length blocks just go away */
+		if(n <= 0){
+			freeb(first);
+			goto again;
+		}
+		/* and following blocks that fit are read as well */
+		l = &first->next;
+		while((b = spscpeek(q)) != nil && n+BLEN(b) <= len){
+			n += BLEN(b);
+			*l = spscget(q);
+			l = &b->next;
+		}
+	}
+
+	b = bl2mem(vp, first, len);
+
+	/* take care of any left over partial block */
+	if(b != nil){
+		n -= BLEN(b);
+		if(q->state & Qmsg)
+			freeb(b);
+		else
+			spscputback(q, b);
+	}
+
+	/* restart producer */
+	spscrestart(q);
+	return n;
+}
+
 /*
  *  free a list of blocks
  */
@@ -86,7 +604,8 @@ freeblist(Block *b)
 }
 
 /*
- *  pad a block to the front (or the back if size is negative)
+ *  pad a block to the front (or the back if size is negative).
+ *  external (BEXT) data is read-only and always copied.
  */
 Block*
 padblock(Block *bp, int size)
@@ -96,7 +615,7 @@ padblock(Block *bp, int size)
 
 	QDEBUG checkb(bp, "padblock 1");
 	if(size >= 0){
-		if(bp->rp - bp->base >= size){
+		if((bp->flag & BEXT) == 0 && bp->rp - bp->base >= size){
 			bp->rp -= size;
 			return bp;
 		}
@@ -118,7 +637,7 @@ padblock(Block *bp, int size)
 		if(bp->next)
 			panic("padblock %#p", getcallerpc(&bp));
 
-		if(bp->lim - bp->wp >= size)
+		if((bp->flag & BEXT) == 0 && bp->lim - bp->wp >= size)
 			return bp;
 
 		n = BLEN(bp);
@@ -207,9 +726,10 @@ pullupblock(Block *bp, int n)
 
 	/*
 	 *  if not enough room in the first block,
-	 *  add another to the front of the list.
+	 *  or it is read-only (BEXT), add another
+	 *  to the front of the list.
 	 */
-	if(bp->lim - bp->rp < n){
+	if((bp->flag & BEXT) != 0 || bp->lim - bp->rp < n){
 		nbp = allocb(n);
 		nbp->next = bp;
 		bp = nbp;
@@ -260,6 +780,7 @@ pullupqueue(Queue *q, int n)
 {
 	Block *b;
 
+	nospsc(q, "pullupqueue");
 	if(BLEN(q->bfirst) >= n)
 		return q->bfirst;
 	q->bfirst = pullupblock(q->bfirst, n);
@@ -294,6 +815,8 @@ trimblock(Block *bp, int offset, int len)
 
 	startb = bp;
 	bp->rp += offset;
+	if(bp->flag & BEXT)
+		bp->base = bp->rp;
 
 	while((l = BLEN(bp)) < len) {
 		len -= l;
@@ -301,6 +824,8 @@ trimblock(Block *bp, int offset, int len)
 	}
 
 	bp->wp -= (BLEN(bp) - len);
+	if(bp->flag & BEXT)
+		bp->lim = bp->wp;
 
 	if(bp->next) {
 		freeblist(bp->next);
@@ -344,6 +869,39 @@ copyblock(Block *bp, int count)
 	return nbp;
 }
 
+/*
+ *  leave the first n bytes in bp and return a block
+ *  with the rest.  blocks sharing a page (see pageblock)
+ *  are split without copying.
+ */
+Block*
+splitblock(Block *bp, int n)
+{
+	int len;
+	Block *nbp;
+
+	QDEBUG checkb(bp, "splitblock 0");
+	len = BLEN(bp) - n;
+	if(len < 0)
+		panic("splitblock %#p", getcallerpc(&bp));
+	if((bp->flag & BEXT) != 0 && bp->pg != nil && bp->free == nil)
+		nbp = extblock(bp->rp+n, len, bp->pg, nil, nil);
+	else{
+		nbp = allocb(len);
+		memmove(nbp->wp, bp->rp+n, len);
+		nbp->wp += len;
+		splitblockcnt++;
+	}
+	bp->wp = bp->rp + n;
+	if(bp->flag & BEXT){
+		/* the rest belongs to nbp now */
+		bp->base = bp->rp;
+		bp->lim = bp->wp;
+	}
+	QDEBUG checkb(nbp, "splitblock 1");
+	return nbp;
+}
+
 Block*
 adjustblock(Block* bp, int len)
 {
@@ -415,6 +973,13 @@ qget(Queue *q)
 	int dowakeup;
 	Block *b;
 
+	if(q->state & Qspsc){
+		b = spscget(q);
+		if(b != nil)
+			spscrestart(q);
+		return b;
+	}
+
 	/* sync with qwrite */
 	ilock(q);
 
@@ -428,6 +993,7 @@ qget(Queue *q)
 	b->next = 0;
 	q->len -= BALLOC(b);
 	q->dlen -= BLEN(b);
+	qstout(q, 1, BLEN(b));
 	QDEBUG checkb(b, "qget");
 
 	/* if writer flow controlled, restart */
@@ -452,8 +1018,10 @@ int
 qdiscard(Queue *q, int len)
 {
 	Block *b;
-	int dowakeup, n, sofar;
+	int dowakeup, n, nb, sofar;
 
+	nospsc(q, "qdiscard");
+	nb = 0;
 	ilock(q);
 	for(sofar = 0; sofar < len; sofar += n){
 		b = q->bfirst;
@@ -467,12 +1035,14 @@ qdiscard(Queue *q, int len)
 			q->len -= BALLOC(b);
 			q->dlen -= BLEN(b);
 			freeb(b);
+			nb++;
 		} else {
 			n = len - sofar;
 			b->rp += n;
 			q->dlen -= n;
 		}
 	}
+	qstout(q, nb, sofar);
 
 	/*
 	 *  if writer flow controlled, restart
@@ -511,6 +1081,7 @@ qconsume(Queue *q, void *vp, int len)
 	uchar *p = vp;
 	Block *tofree = nil;
 
+	nospsc(q, "qconsume");
 	/* sync with qwrite */
 	ilock(q);
 
@@ -547,11 +1118,13 @@ qconsume(Queue *q, void *vp, int len)
 		b->next = 0;
 		q->len -= BALLOC(b);
 		q->dlen -= BLEN(b);
+		qstout(q, 1, len + BLEN(b));
 
 		/* remember to free this */
 		b->next = tofree;
 		tofree = b;
-	}
+	}else
+		qstout(q, 0, len);
 
 	/* if writer flow controlled, restart */
 	if((q->state & Qflow) && q->len < q->limit/2){
@@ -574,7 +1147,10 @@ qconsume(Queue *q, void *vp, int len)
 int
 qpass(Queue *q, Block *b)
 {
-	int dlen, len, dowakeup;
+	int dlen, len, nb, dowakeup;
+
+	if(q->state & Qspsc)
+		return spscpass(q, b, 0);
 
 	/* sync with qread */
 	dowakeup = 0;
@@ -598,16 +1174,19 @@ qpass(Queue *q, Block *b)
 		q->bfirst = b;
 	len = BALLOC(b);
 	dlen = BLEN(b);
+	nb = 1;
 	QDEBUG checkb(b, "qpass");
 	while(b->next){
 		b = b->next;
 		QDEBUG checkb(b, "qpass");
 		len += BALLOC(b);
 		dlen += BLEN(b);
+		nb++;
 	}
 	q->blast = b;
 	q->len += len;
 	q->dlen += dlen;
+	qstin(q, nb, dlen);
 
 	if(q->len >= q->limit/2)
 		q->state |= Qflow;
@@ -627,7 +1206,10 @@ qpass(Queue *q, Block *b)
 int
 qpassnolim(Queue *q, Block *b)
 {
-	int dlen, len, dowakeup;
+	int dlen, len, nb, dowakeup;
+
+	if(q->state & Qspsc)
+		return spscpass(q, b, 1);
 
 	/* sync with qread */
 	dowakeup = 0;
@@ -647,16 +1229,19 @@ qpassnolim(Queue *q, Block *b)
 		q->bfirst = b;
 	len = BALLOC(b);
 	dlen = BLEN(b);
+	nb = 1;
 	QDEBUG checkb(b, "qpass");
 	while(b->next){
 		b = b->next;
 		QDEBUG checkb(b, "qpass");
 		len += BALLOC(b);
 		dlen += BLEN(b);
+		nb++;
 	}
 	q->blast = b;
 	q->len += len;
 	q->dlen += dlen;
+	qstin(q, nb, dlen);
 
 	if(q->len >= q->limit/2)
 		q->state |= Qflow;
@@ -673,6 +1258,75 @@ qpassnolim(Queue *q, Block *b)
 	return len;
 }
 
+/*
+ *  pass a list of blocks to a queue with a single lock
+ *  and at most one wakeup.  blocks that do not fit below
+ *  the limit are freed; return the number of blocks freed.
+ *  Qspsc queues take the list as a whole, as qpass does.
+ */
+int
+qpasslist(Queue *q, Block *b)
+{
+	int dlen, len, dowakeup, ndrop, nb;
+	Block *next, **l;
+
+	if(q->state & Qspsc){
+		if(spscpass(q, b, 0) < 0)
+			return 1;
+		return 0;
+	}
+
+	/* sync with qread */
+	dowakeup = 0;
+	ndrop = nb = 0;
+	len = dlen = 0;
+	ilock(q);
+	if(q->state & Qclosed){
+		iunlock(q);
+		freeblist(b);
+		return 0;
+	}
+
+	/* add buffers to queue while they fit */
+	l = &q->bfirst;
+	if(q->bfirst)
+		l = &q->blast->next;
+	for(; b != nil; b = next){
+		next = b->next;
+		if(q->len+len >= q->limit){
+			b->next = nil;
+			freeb(b);
+			ndrop++;
+			continue;
+		}
+		QDEBUG checkb(b, "qpasslist");
+		len += BALLOC(b);
+		dlen += BLEN(b);
+		nb++;
+		*l = b;
+		l = &b->next;
+		q->blast = b;
+	}
+	*l = nil;
+	q->len += len;
+	q->dlen += dlen;
+	qstin(q, nb, dlen);
+
+	if(q->len >= q->limit/2)
+		q->state |= Qflow;
+
+	if(len > 0 && (q->state & Qstarve)){
+		q->state &= ~Qstarve;
+		dowakeup = 1;
+	}
+	iunlock(q);
+
+	if(dowakeup)
+		wakeup(&q->rr);
+
+	return ndrop;
+}
+
 /*
  *  if the allocated space is way out of line with the used
  *  space, reallocate to a smaller block
@@ -705,6 +1359,7 @@ qproduce(Queue *q, void *vp, int len)
 	int dowakeup;
 	uchar *p = vp;
 
+	nospsc(q, "qproduce");
 	/* sync with qread */
 	dowakeup = 0;
 	ilock(q);
@@ -733,6 +1388,7 @@ qproduce(Queue *q, void *vp, int len)
 	/* b->next = 0; done by iallocb() */
 	q->len += BALLOC(b);
 	q->dlen += BLEN(b);
+	qstin(q, 1, BLEN(b));
 	QDEBUG checkb(b, "qproduce");
 
 	if(q->state & Qstarve){
@@ -761,6 +1417,7 @@ qcopy(Queue *q, int len, ulong offset)
 	Block *b, *nb;
 	uchar *p;
 
+	nospsc(q, "qcopy");
 	nb = allocb(len);
 
 	ilock(q);
@@ -817,6 +1474,14 @@ qopen(int limit, int msg, void (*kick)(void*), void *arg)
 	q->kick = kick;
 	q->arg = arg;
 	q->state = msg;
+	if(msg & Qspsc){
+		q->nring = Nspsc;
+		q->ring = malloc(q->nring*sizeof(Block*));
+		if(q->ring == nil){
+			free(q);
+			return 0;
+		}
+	}
 
 	q->state |= Qstarve;
 	q->eof = 0;
@@ -858,6 +1523,8 @@ notempty(void *a)
 static int
 qwait(Queue *q)
 {
+	uvlong t0;
+
 	/* wait for data */
 	for(;;){
 		if(q->bfirst != nil)
@@ -873,8 +1540,13 @@ qwait(Queue *q)
 
 		q->state |= Qstarve;	/* flag requesting producer to wake me */
 		iunlock(q);
+		t0 = fastticks(nil);
 		sleep(&q->rr, notempty, q);
 		ilock(q);
+		if(q->st != nil){
+			q->st->nrwait++;
+			q->st->rwait += fastticks2us(fastticks(nil) - t0);
+		}
 	}
 	return 1;
 }
@@ -885,16 +1557,20 @@ qwait(Queue *q)
 void
 qaddlist(Queue *q, Block *b)
 {
+	int dlen, nb;
+
 	/* queue the block */
 	if(q->bfirst)
 		q->blast->next = b;
 	else
 		q->bfirst = b;
+	dlen = blocklen(b);
 	q->len += blockalloclen(b);
-	q->dlen += blocklen(b);
-	while(b->next)
+	q->dlen += dlen;
+	for(nb = 1; b->next; nb++)
 		b = b->next;
 	q->blast = b;
+	qstin(q, nb, dlen);
 }
 
 /*
@@ -912,6 +1588,7 @@ qremove(Queue *q)
 	b->next = nil;
 	q->dlen -= BLEN(b);
 	q->len -= BALLOC(b);
+	qstout(q, 1, BLEN(b));
 	QDEBUG checkb(b, "qremove");
 	return b;
 }
@@ -991,6 +1668,7 @@ qputback(Queue *q, Block *b)
 	q->bfirst = b;
 	q->len += BALLOC(b);
 	q->dlen += BLEN(b);
+	qstout(q, -1, -BLEN(b));
 }
 
 /*
@@ -1029,6 +1707,9 @@ qbread(Queue *q, int len)
 	Block *b, *nb;
 	int n;
 
+	if(q->state & Qspsc)
+		return spscbread(q, len);
+
 	qlock(&q->rlock);
 	if(waserror()){
 		qunlock(&q->rlock);
@@ -1056,13 +1737,8 @@ qbread(Queue *q, int len)
 	/* split block if it's too big and this is not a message queue */
 	nb = b;
 	if(n > len){
-		if((q->state&Qmsg) == 0){
-			n -= len;
-			b = allocb(n);
-			memmove(b->wp, nb->rp+len, n);
-			b->wp += n;
-			qputback(q, b);
-		}
+		if((q->state&Qmsg) == 0)
+			qputback(q, splitblock(nb, len));
 		nb->wp = nb->rp + len;
 	}
 
@@ -1074,6 +1750,66 @@ qbread(Queue *q, int len)
 	return nb;
 }
 
+/*
+ *  get the next blocks from a queue (up to a limit):
+ *  the first block, split if it's too big as in qbread,
+ *  and then as many whole blocks as fit.  the queue is
+ *  locked once and the producer restarted at most once.
+ *  Qspsc queues return a single block, as qbread does.
+ */
+Block*
+qbreadlist(Queue *q, int len)
+{
+	Block *b, *first, **l;
+	int n;
+
+	if(q->state & Qspsc)
+		return spscbread(q, len);
+
+	qlock(&q->rlock);
+	if(waserror()){
+		qunlock(&q->rlock);
+		nexterror();
+	}
+
+	ilock(q);
+	switch(qwait(q)){
+	case 0:
+		/* queue closed */
+		iunlock(q);
+		qunlock(&q->rlock);
+		poperror();
+		return nil;
+	case -1:
+		/* multiple reads on a closed queue */
+		iunlock(q);
+		error(q->err);
+	}
+
+	/* if we get here, there's at least one block in the queue */
+	first = qremove(q);
+	n = BLEN(first);
+	if(n > len){
+		if((q->state&Qmsg) == 0)
+			qputback(q, splitblock(first, len));
+		first->wp = first->rp + len;
+		n = len;
+	}
+	l = &first->next;
+	while((b = q->bfirst) != nil && n+BLEN(b) <= len){
+		n += BLEN(b);
+		*l = qremove(q);
+		l = &b->next;
+	}
+
+	/* restart producer */
+	qwakeup_iunlock(q);
+
+	poperror();
+	qunlock(&q->rlock);
+	return first;
+}
+
 /*
  *  read a queue.  if no data is queued, post a Block
  *  and wait on its Rendez.
@@ -1084,6 +1820,9 @@ qread(Queue *q, void *vp, int len)
 	Block *b, *first, **l;
 	int blen, n;
 
+	if(q->state & Qspsc)
+		return spscread(q, vp, len);
+
 	qlock(&q->rlock);
 	if(waserror()){
 		qunlock(&q->rlock);
@@ -1168,33 +1907,40 @@ qnotfull(void *a)
 	return q->len < q->limit || (q->state & Qclosed);
 }
 
-ulong noblockcnt;
-
 /*
- *  add a block to a queue obeying flow control
+ *  add a block to a queue obeying flow control.
+ *  b may be a list of blocks (eg. fragments kept in
+ *  external pages); they are queued without copying
+ *  but for message queues, where they are concatenated.
  */
 long
 qbwrite(Queue *q, Block *b)
 {
 	int n, dowakeup;
+	uvlong t0;
 	Proc *p;
 
-	n = BLEN(b);
+	n = blocklen(b);
 
 	if(q->bypass){
 		(*q->bypass)(q->arg, b);
 		return n;
 	}
+	if(q->state & Qspsc)
+		return spscbwrite(q, b);
 
 	dowakeup = 0;
 	qlock(&q->wlock);
 	if(waserror()){
 		if(b != nil)
-			freeb(b);
+			freeblist(b);
 		qunlock(&q->wlock);
 		nexterror();
 	}
 
+	if(b->next != nil && (q->state&Qmsg) != 0)
+		b = concatblock(b);
+
 	ilock(q);
 
 	/* give up if the queue is closed */
@@ -1207,7 +1953,7 @@ qbwrite(Queue *q, Block *b)
 	if(q->len >= q->limit){
 		if(q->noblock){
 			iunlock(q);
-			freeb(b);
+			freeblist(b);
 			noblockcnt += n;
 			qunlock(&q->wlock);
 			poperror();
@@ -1216,15 +1962,8 @@ qbwrite(Queue *q, Block *b)
 	}
 
 	/* queue the block */
-	if(q->bfirst)
-		q->blast->next = b;
-	else
-		q->bfirst = b;
-	q->blast = b;
-	b->next = 0;
-	q->len += BALLOC(b);
-	q->dlen += n;
 	QDEBUG checkb(b, "qbwrite");
+	qaddlist(q, b);
 	b = nil;
 
 	/* make sure other end gets awakened */
@@ -1267,7 +2006,12 @@ qbwrite(Queue *q, Block *b)
 		ilock(q);
 		q->state |= Qflow;
 		iunlock(q);
+		t0 = fastticks(nil);
 		sleep(&q->wr, qnotfull, q);
+		if(q->st != nil){
+			q->st->nwwait++;
+			q->st->wwait += fastticks2us(fastticks(nil) - t0);
+		}
 	}
 	USED(b);
 
@@ -1327,6 +2071,7 @@ qiwrite(Queue *q, void *vp, int len)
 	Block *b;
 	uchar *p = vp;
 
+	nospsc(q, "qiwrite");
 	dowakeup = 0;
 
 	sofar = 0;
@@ -1360,6 +2105,7 @@ qiwrite(Queue *q, void *vp, int len)
 		q->blast = b;
 		q->len += BALLOC(b);
 		q->dlen += n;
+		qstin(q, 1, n);
 
 		if(q->state & Qstarve){
 			q->state &= ~Qstarve;
@@ -1388,6 +2134,11 @@ void
 qfree(Queue *q)
 {
 	qclose(q);
+	qunname(q);
+	if(q->state & Qspsc){
+		spscdrain(q);
+		free(q->ring);
+	}
 	free(q);
 }
 
@@ -1412,6 +2163,8 @@ qclose(Queue *q)
 	q->bfirst = 0;
 	q->len = 0;
 	q->dlen = 0;
+	if(q->st != nil)
+		qstupdate(q->st, 0);
 	q->noblock = 0;
 	iunlock(q);
 
@@ -1465,6 +2218,8 @@ qreopen(Queue *q)
 	q->eof = 0;
 	q->limit = q->inilim;
 	iunlock(q);
+	if(q->state & Qspsc)
+		spscdrain(q);
 }
 
 /*
@@ -1473,6 +2228,8 @@ qreopen(Queue *q)
 int
 qlen(Queue *q)
 {
+	if(q->state & Qspsc)
+		return q->ndin - q->ndout;
 	return q->dlen;
 }
 
@@ -1484,7 +2241,10 @@ qwindow(Queue *q)
 {
 	int l;
 
-	l = q->limit - q->len;
+	if(q->state & Qspsc)
+		l = q->limit - spsclen(q);
+	else
+		l = q->limit - q->len;
 	if(l < 0)
 		l = 0;
 	return l;
@@ -1496,6 +2256,8 @@ qwindow(Queue *q)
 int
 qcanread(Queue *q)
 {
+	if(q->state & Qspsc)
+		return q->rfirst != nil || q->rhead != q->rtail;
 	return q->bfirst!=0;
 }
 
@@ -1525,12 +2287,15 @@ qflush(Queue *q)
 {
 	Block *bfirst;
 
+	nospsc(q, "qflush");
 	/* mark it */
 	ilock(q);
 	bfirst = q->bfirst;
 	q->bfirst = 0;
 	q->len = 0;
 	q->dlen = 0;
+	if(q->st != nil)
+		qstupdate(q->st, 0);
 	iunlock(q);
 
 	/* free queued blocks */
@@ -1543,6 +2308,8 @@ qflush(Queue *q)
 int
 qfull(Queue *q)
 {
+	if(q->state & Qspsc)
+		return spsclen(q) >= q->limit;
 	return q->state & Qflow;
 }
 
@@ -1551,3 +2318,137 @@ qstate(Queue *q)
 {
 	return q->state;
 }
+
+/*
+ *  microbenchmark: a kproc writes nb blocks of sz bytes
+ *  to a queue read by a kproc wired to another core.
+ *	qbench [spsc] nb sz
+ */
+typedef struct Qbench Qbench;
+struct Qbench
+{
+	Lock;			/* held for ndone++ and its wakeup */
+	Queue*	q;
+	int	nb;
+	int	sz;
+	int	ndone;
+	Rendez	r;
+};
+
+static int
+qbenchdone(void *a)
+{
+	Qbench *qb = a;
+
+	return qb->ndone == 2;
+}
+
+static void
+qbenchexit(Qbench *qb)
+{
+	lock(qb);
+	qb->ndone++;
+	wakeup(&qb->r);
+	unlock(qb);
+	pexit("", 1);
+}
+
+static void
+qbenchwr(void *a)
+{
+	Qbench *qb;
+	Block *b;
+	int i;
+
+	qb = a;
+	procwired(up, 0);
+	sched();
+	if(!waserror()){
+		for(i = 0; i < qb->nb; i++){
+			b = allocb(qb->sz);
+			b->wp += qb->sz;
+			qbwrite(qb->q, b);
+		}
+		poperror();
+	}
+	qbenchexit(qb);
+}
+
+static void
+qbenchrd(void *a)
+{
+	Qbench *qb;
+	Block *b;
+	vlong n;
+
+	qb = a;
+	procwired(up, 1);
+	sched();
+	if(!waserror()){
+		for(n = (vlong)qb->nb*qb->sz; n > 0; ){
+			b = qbread(qb->q, qb->sz);
+			if(b == nil)
+				break;
+			n -= BLEN(b);
+			freeb(b);
+		}
+		poperror();
+	}
+	qbenchexit(qb);
+}
+
+void
+qbench(char *a, long n)
+{
+	Cmdbuf *cb;
+	Qbench *qb;
+	int i, msg;
+	uvlong t0, ns;
+
+	if(sys->nonline < 2)
+		error("qbench needs two cores");
+	cb = parsecmd(a, n);
+	if(waserror()){
+		free(cb);
+		nexterror();
+	}
+	i = 1;
+	msg = 0;
+	if(cb->nf > i && strcmp(cb->f[i], "spsc") == 0){
+		msg = Qspsc;
+		i++;
+	}
+	if(cb->nf != i+2)
+		error(Ebadctl);
+	qb = smalloc(sizeof *qb);
+	qb->nb = strtol(cb->f[i], 0, 0);
+	qb->sz = strtol(cb->f[i+1], 0, 0);
+	if(qb->nb <= 0 || qb->sz <= 0 || qb->sz > Maxatomic){
+		free(qb);
+		error(Ebadarg);
+	}
+	qb->q = qopen(64*1024, msg, nil, nil);
+	if(qb->q == nil){
+		free(qb);
+		error(Enomem);
+	}
+	poperror();
+	free(cb);
+
+	t0 = fastticks(nil);
+	kproc("qbenchrd", qbenchrd, qb);
+	kproc("qbenchwr", qbenchwr, qb);
+	while(waserror())
+		qhangup(qb->q, "qbench interrupted");
+	sleep(&qb->r, qbenchdone, qb);
+	poperror();
+	ns = fastticks2ns(fastticks(nil) - t0);
+
+	print("qbench%s: %d blocks of %d bytes: %llud ns, %llud ns/block\n",
+		msg? " spsc" : "", qb->nb, qb->sz, ns, ns/qb->nb);
+	/* the last kproc may still be in qbenchexit */
+	lock(qb);
+	unlock(qb);
+	qfree(qb->q);
+	free(qb);
+}
@@ -7,6 +7,15 @@
  *	Tries to avoid external fragmentation by
  *	using a larger atomic unit, caching most of the mallocs
  *	in the kernel and rounding allocations.
+ *
+ *	Small blocks are also cached in per-cpu magazines, in front
+ *	of the quick lists, so that most malloc/free calls for them
+ *	take no locks. Magazines get and return blocks from/to the
+ *	quick lists in batches.
+ *
+ *	A sampling heap profiler keeps the live bytes allocated by
+ *	each caller pc, for a sample of the allocations, one every
+ *	HProfrate bytes allocated (see #K/kpheap).
  */
 #include "u.h"
 #include "../port/lib.h"
@@ -20,15 +29,19 @@
 
 typedef union Header Header;
 typedef struct Qlist Qlist;
+typedef struct Qmag Qmag;
 typedef struct MSeg MSeg;
 typedef struct Pcx Pcx;
 typedef struct Pcc Pcc;
+typedef struct Hpsite Hpsite;
+typedef struct Hpblk Hpblk;
 
 /* stats */
 enum
 {
 	QSmalloc,
 	QSmallocquick,
+	QSmallocmag,
 	QSmallocrover,
 	QSmalloctail,
 	QSmalign,
@@ -41,6 +54,7 @@ enum
 	QSfree,
 	QSfreetail,
 	QSfreequick,
+	QSfreemag,
 	QSfreeprev,
 	QSfreefrag,
 	QSrealloc,
@@ -77,6 +91,14 @@ enum
 	 */
 	NQUICK = HOWMANY(8192+IOHDRSZ+1, Unitsz*Mult)*Mult + 1,
 
+	/*
+	 * blocks up to NMAGUNITS units are kept in per-cpu
+	 * magazines of up to NMAG blocks, or MAGBYTES bytes.
+	 */
+	NMAGUNITS = 1+Mult*16,
+	NMAG = 32,
+	MAGBYTES = 8*KiB,
+
 	ATAG = 0x99u,
 	FTAG = 0x66u,
 };
@@ -88,6 +110,15 @@ struct Qlist
 	uint	nalloc;
 };
 
+struct Qmag
+{
+	Header*	first;
+	uint	n;
+	uint	max;
+	ulong	nhits;
+	ulong	nmiss;
+};
+
 struct MSeg
 {
 	Header*	base;		/* base of malloc area */
@@ -113,6 +144,56 @@ struct Pcc
 	uint max;
 };
 
+/*
+ * Heap profile: call sites and sampled blocks still allocated.
+ */
+struct Hpsite
+{
+	uintptr	pc;
+	ulong	nalloc;		/* samples taken */
+	uvlong	nbytes;		/* bytes sampled */
+	ulong	nlive;		/* samples not yet freed */
+	uvlong	live;		/* bytes in them */
+	uvlong	liveest;	/* live bytes estimated from them */
+	Hpsite*	next;
+};
+
+struct Hpblk
+{
+	void*	v;
+	ulong	size;
+	ulong	est;
+	Hpsite*	site;
+	Hpblk*	next;
+};
+
+enum
+{
+	HProfrate = 512*KiB,	/* default bytes between samples */
+	NHPSITE = 1024,
+	NHPBLK = 8192,
+	NHPHASH = 512,
+};
+
+#define HPHASH(x)	((((uintptr)(x))>>5) % NHPHASH)
+
+static struct
+{
+	Lock;
+	int	on;
+	ulong	rate;
+	int	nblk;		/* sampled blocks in use */
+	ulong	nsamples;
+	ulong	ndropped;	/* no room for the sample */
+	long	left[MACHMAX];	/* bytes until next sample */
+	Hpsite*	sitehash[NHPHASH];
+	Hpblk*	blkhash[NHPHASH];
+	Hpblk*	freeblk;
+	int	nsite;
+	Hpsite	site[NHPSITE];
+	Hpblk	blk[NHPBLK];
+} hprof;
+
 /* ((x) != 0) && ... */
 #define ISPOWEROF2(x)	(!((x) & ((x)-1)))
 #define ALIGNHDR(h, a)	(Header*)((((uintptr)(h))+((a)-1)) & ~((a)-1))
@@ -130,6 +211,7 @@ static	int	qstats[NQStats];
 
 
 static	Qlist	quicklist[NQUICK+1];
+static	Qmag	qmag[MACHMAX][NMAGUNITS+1];
 
 static	Lock	mainlock;
 static	MSeg	mseg0, *mseg;
@@ -142,6 +224,7 @@ static	char*	qstatname[NQStats] =
 {
 [QSmalloc]	"QSmalloc",
 [QSmallocquick]	"QSmallocquick",
+[QSmallocmag]	"QSmallocmag",
 [QSmallocrover]	"QSmallocrover",
 [QSmalloctail]	"QSmalloctail",
 [QSmalign]	"QSmalign",
@@ -154,6 +237,7 @@ static	char*	qstatname[NQStats] =
 [QSfree]	"QSfree",
 [QSfreetail]	"QSfreetail",
 [QSfreequick]	"QSfreequick",
+[QSfreemag]	"QSfreemag",
 [QSfreeprev]	"QSfreeprev",
 [QSfreefrag]	"QSfreefrag",
 [QSrealloc]	"QSrealloc",
@@ -237,12 +321,218 @@ forget(void *v)
 	iunlock(&pcxlock);
 }
 
+/*
+ * Sample the allocation of v by pc, if it's time.
+ * Cheap unless a sample is taken.
+ * The per-cpu countdown is racy; but it's a sample.
+ */
+static void
+hpsample(void *v, uintptr pc, ulong size)
+{
+	long *left;
+	Hpsite *s;
+	Hpblk *b;
+	ulong est;
+	int h;
+
+	if(hprof.on == 0 || v == nil)
+		return;
+	left = &hprof.left[m->machno];
+	*left -= size;
+	if(*left > 0)
+		return;
+	*left = hprof.rate;
+	est = hprof.rate;
+	if(size > est)
+		est = size;
+
+	ilock(&hprof);
+	if(!hprof.on){
+		iunlock(&hprof);
+		return;
+	}
+	hprof.nsamples++;
+	h = HPHASH(pc);
+	for(s = hprof.sitehash[h]; s != nil; s = s->next)
+		if(s->pc == pc)
+			break;
+	if(s == nil){
+		if(hprof.nsite == NHPSITE || hprof.freeblk == nil){
+			hprof.ndropped++;
+			iunlock(&hprof);
+			return;
+		}
+		s = &hprof.site[hprof.nsite++];
+		s->pc = pc;
+		s->next = hprof.sitehash[h];
+		hprof.sitehash[h] = s;
+	}
+	if((b = hprof.freeblk) == nil){
+		hprof.ndropped++;
+		iunlock(&hprof);
+		return;
+	}
+	hprof.freeblk = b->next;
+	hprof.nblk++;
+	b->v = v;
+	b->size = size;
+	b->est = est;
+	b->site = s;
+	s->nalloc++;
+	s->nbytes += size;
+	s->nlive++;
+	s->live += size;
+	s->liveest += est;
+	h = HPHASH(v);
+	b->next = hprof.blkhash[h];
+	hprof.blkhash[h] = b;
+	iunlock(&hprof);
+}
+
+/*
+ * v is being freed; forget its sample if any.
+ * Most blocks are not sampled and are discarded without
+ * taking the lock, by looking at their hash bucket;
+ * v cannot be added to it while being freed.
+ */
+static void
+hpfree(void *v)
+{
+	Hpblk **bp, *b;
+	Hpsite *s;
+
+	if(hprof.nblk == 0 || hprof.blkhash[HPHASH(v)] == nil)
+		return;
+	ilock(&hprof);
+	for(bp = &hprof.blkhash[HPHASH(v)]; (b = *bp) != nil; bp = &b->next)
+		if(b->v == v){
+			*bp = b->next;
+			s = b->site;
+			s->nlive--;
+			s->live -= b->size;
+			s->liveest -= b->est;
+			b->next = hprof.freeblk;
+			hprof.freeblk = b;
+			hprof.nblk--;
+			break;
+		}
+	iunlock(&hprof);
+}
+
+static void
+hpreset(void)
+{
+	int i;
+
+	ilock(&hprof);
+	memset(hprof.sitehash, 0, sizeof hprof.sitehash);
+	memset(hprof.blkhash, 0, sizeof hprof.blkhash);
+	hprof.nsite = 0;
+	hprof.nblk = 0;
+	hprof.nsamples = 0;
+	hprof.ndropped = 0;
+	hprof.freeblk = nil;
+	for(i = 0; i < NHPBLK; i++){
+		hprof.blk[i].next = hprof.freeblk;
+		hprof.freeblk = &hprof.blk[i];
+	}
+	iunlock(&hprof);
+}
+
+/*
+ * ctl messages: start, stop, reset, rate n (bytes).
+ */
+void
+heapprofctl(char *a, long n)
+{
+	Cmdbuf *cb;
+	long rate;
+
+	cb = parsecmd(a, n);
+	if(waserror()){
+		free(cb);
+		nexterror();
+	}
+	if(cb->nf < 1)
+		error(Ebadctl);
+	if(strcmp(cb->f[0], "start") == 0){
+		if(hprof.rate == 0)
+			hprof.rate = HProfrate;
+		if(hprof.freeblk == nil && hprof.nblk == 0)
+			hpreset();
+		hprof.on = 1;
+	}else if(strcmp(cb->f[0], "stop") == 0)
+		hprof.on = 0;
+	else if(strcmp(cb->f[0], "reset") == 0)
+		hpreset();
+	else if(strcmp(cb->f[0], "rate") == 0 && cb->nf == 2){
+		rate = strtol(cb->f[1], 0, 0);
+		if(rate <= 0)
+			error(Ebadarg);
+		hprof.rate = rate;
+	}else
+		error(Ebadctl);
+	poperror();
+	free(cb);
+}
+
+/*
+ * One line per site with live samples:
+ *	src(pc) nlive live liveest nalloc nbytes
+ * liveest estimates the live bytes allocated by pc.
+ */
+long
+heapprofread(void *a, long n, vlong offset)
+{
+	char *buf, *s, *e;
+	Hpsite *hs, *sites;
+	int i, on, nsite;
+	ulong rate, nsamples, ndropped;
+
+	buf = malloc(NHPSITE*80+256);
+	sites = malloc(NHPSITE*sizeof(Hpsite));
+	if(buf == nil || sites == nil){
+		free(buf);
+		free(sites);
+		error(Enomem);
+	}
+
+	/* copy under the lock; print without it */
+	ilock(&hprof);
+	on = hprof.on;
+	rate = hprof.rate;
+	nsamples = hprof.nsamples;
+	ndropped = hprof.ndropped;
+	nsite = hprof.nsite;
+	memmove(sites, hprof.site, nsite*sizeof(Hpsite));
+	iunlock(&hprof);
+
+	s = buf;
+	e = buf + NHPSITE*80+256;
+	s = seprint(s, e, "heap profile: %s rate %lud samples %lud dropped %lud\n",
+		on ? "on" : "off", rate, nsamples, ndropped);
+	s = seprint(s, e, "pc nlive live liveest nalloc nbytes\n");
+	for(i = 0; i < nsite; i++){
+		hs = &sites[i];
+		if(hs->nlive == 0)
+			continue;
+		s = seprint(s, e, "src(%#p) %lud %llud %llud %lud %llud\n",
+			hs->pc, hs->nlive, hs->live, hs->liveest,
+			hs->nalloc, hs->nbytes);
+	}
+	USED(s);
+	free(sites);
+	n = readstr(offset, a, n, buf);
+	free(buf);
+	return n;
+}
 
 static char*
 mallocsummary(char* s, char* e, void*)
 {
 	uintmem used, tot;
-	int n;
+	int i, j, n;
+	ulong nhits, nmiss;
 	MSeg *mseg;
 
 	used = 0;
@@ -253,7 +543,23 @@ mallocsummary(char* s, char* e, void*)
 		tot += (mseg->end - mseg->base)*Unitsz;
 		n++;
 	}
-	return seprint(s, e, "%llud/%llud malloc %d segs\n", used, tot, n);
+	s = seprint(s, e, "%llud/%llud malloc %d segs\n", used, tot, n);
+
+	/* race; but stat only */
+	for(i = 2; i <= NMAGUNITS; i++){
+		nhits = nmiss = 0;
+		n = 0;
+		for(j = 0; j < MACHMAX; j++){
+			nhits += qmag[j][i].nhits;
+			nmiss += qmag[j][i].nmiss;
+			n += qmag[j][i].n;
+		}
+		if(nhits+nmiss != 0)
+			s = seprint(s, e, "%d malloc %ud bytes in mags "
+				"%lud hits %lud misses\n",
+				n, (i-1)*Unitsz, nhits, nmiss);
+	}
+	return s;
 }
 
 static MSeg*
@@ -321,6 +627,84 @@ tailalloc(uint n)
 	return p;
 }
 
+/*
+ * Get a block of nunits from the magazine for this cpu,
+ * refilling it from the quick list if it's empty.
+ * Magazines are only used by their cpu, at splhi.
+ */
+static Header*
+magget(uint nunits)
+{
+	Qmag *mag;
+	Qlist *qlist;
+	Header *p;
+	Mpl s;
+
+	s = splhi();
+	mag = &qmag[m->machno][nunits];
+	if(mag->first == nil){
+		mag->nmiss++;
+		qlist = &quicklist[nunits];
+		ilock(&qlist->lk);
+		while(mag->n < mag->max/2 && (p = qlist->first) != nil){
+			qlist->first = p->s.next;
+			p->s.next = mag->first;
+			mag->first = p;
+			mag->n++;
+		}
+		iunlock(&qlist->lk);
+		if(mag->first == nil){
+			splx(s);
+			return nil;
+		}
+	}else
+		mag->nhits++;
+	p = mag->first;
+	mag->first = p->s.next;
+	mag->n--;
+	splx(s);
+	p->s.next = nil;
+	if(p->s.size != nunits)
+		panic("magget: %d\t%#p %ud", nunits, p, p->s.size);
+	((uchar*)(p+nunits))[-1] = ATAG;
+	return p;
+}
+
+/*
+ * Put a block in the magazine for this cpu, giving half
+ * of it back to the quick list if it's full.
+ * The block has been checked by the caller.
+ */
+static void
+magput(Header *p)
+{
+	Qmag *mag;
+	Qlist *qlist;
+	Header *l, *t;
+	uint nunits, n;
+	Mpl s;
+
+	nunits = p->s.size;
+	s = splhi();
+	mag = &qmag[m->machno][nunits];
+	if(mag->n >= mag->max){
+		l = mag->first;
+		for(t = l, n = 1; n < mag->n/2; n++)
+			t = t->s.next;
+		mag->first = t->s.next;
+		mag->n -= n;
+		qlist = &quicklist[nunits];
+		ilock(&qlist->lk);
+		t->s.next = qlist->first;
+		qlist->first = l;
+		iunlock(&qlist->lk);
+	}
+	p->s.next = mag->first;
+	mag->first = p;
+	mag->n++;
+	splx(s);
+}
+
 static void*
 qmallocalign(usize nbytes, uintptr align)
 {
@@ -476,6 +860,10 @@ qmalloc(usize nbytes)
 
 	qstats[QSmalloc]++;
 	nunits = NUNITS(nbytes);
+	if(nunits <= NMAGUNITS && (p = magget(nunits)) != nil){
+		qstats[QSmallocmag]++;
+		return p+1;
+	}
 	if(nunits <= NQUICK){
 		nq = 1;
 		if(nunits > Mult)
@@ -776,10 +1164,41 @@ mallocdump(void*)
 void
 free(void* ap)
 {
+	Header *p;
+	MSeg *s;
+	uint nunits;
+
 	if(ap == nil)
 		return;
 	if(DEBUGALLOC != 0)
 		forget(ap);
+	hpfree(ap);
+
+	/*
+	 * Small blocks go to the magazines, after
+	 * the checks made by qfreeinternal.
+	 */
+	p = ap;
+	p--;
+	nunits = p->s.size;
+	if(nunits != 0 && nunits <= NMAGUNITS && p->s.next == nil){
+		for(s = &mseg0; s != nil; s = s->next)
+			if(ap >= s->base && ap < s->end)
+				break;
+		if(s == nil)
+			panic("free: not from malloc");
+		if(((uchar*)(p+nunits))[-1] == FTAG)
+			panic("free: double free");
+		if(((uchar*)(p+nunits))[-1] != ATAG)
+			panic("free: user overflow");
+		if(poison)
+			memset(p+1, 0x99, (nunits-1)*Unitsz);
+		((uchar*)(p+nunits))[-1] = FTAG;
+		qstats[QSfree]++;
+		qstats[QSfreemag]++;
+		magput(p);
+		return;
+	}
 
 	ilock(&mainlock);
 	for(mseg = &mseg0; mseg != nil; mseg = mseg->next)
@@ -798,6 +1217,7 @@ malloc(ulong size)
 
 	v = qmalloc(size);
 	setmalloctag(v, getcallerpc(&size));
+	hpsample(v, getcallerpc(&size), size);
 	memset(v, 0, size);
 	return v;
 }
@@ -809,6 +1229,7 @@ smalloc(ulong size)
 
 	v = qmalloc(size);
 	setmalloctag(v, getcallerpc(&size));
+	hpsample(v, getcallerpc(&size), size);
 	memset(v, 0, size);
 	return v;
 }
@@ -820,6 +1241,7 @@ mallocz(ulong size, int clr)
 
 	v = qmalloc(size);
 	setmalloctag(v, getcallerpc(&size));
+	hpsample(v, getcallerpc(&size), size);
 	if(clr)
 		memset(v, 0, size);
 	return v;
@@ -845,6 +1267,7 @@ mallocalign(ulong nbytes, ulong align, long offset, ulong span)
 			getcallerpc(&nbytes));
 	v = qmallocalign(nbytes, align);
 	setmalloctag(v, getcallerpc(&nbytes));
+	hpsample(v, getcallerpc(&nbytes), nbytes);
 	if((uintptr)v & (align-1))
 		panic("mallocalign: %#p not aligned to %#ulx\n", v, align);
 	memset(v, 0, nbytes);
@@ -854,12 +1277,22 @@ mallocalign(ulong nbytes, ulong align, long offset, ulong span)
 void
 mallocinit(void)
 {
+	int i, n;
+
 	if(mseg0.tailptr != nil)
 		return;
 	if(!ISPOWEROF2(Unitsz))
 		panic("mallocinit: Unitsz");
 	mseg = &mseg0;
 	mallocinitseg(mseg, UINT2PTR(sys->vmunused), sys->vmend - sys->vmunused);
+	for(i = 0; i < MACHMAX; i++)
+		for(n = 0; n <= NMAGUNITS; n++){
+			qmag[i][n].max = MAGBYTES/((n+1)*Unitsz);
+			if(qmag[i][n].max > NMAG)
+				qmag[i][n].max = NMAG;
+			if(qmag[i][n].max < 4)
+				qmag[i][n].max = 4;
+		}
 	addsummary(iallocsummary, nil);
 	addsummary(mallocsummary, nil);
 	addttescape('x', mallocdump, nil);
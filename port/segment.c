@@ -134,6 +134,7 @@ void
 initseg(void)
 {
 	addsummary(segsummary, nil);
+	faultinit();
 	addttescape('P', segdump, nil);
 }
 
@@ -260,13 +261,13 @@ segreclaim(void)
 	if(!canqlock(&segcache.reclaimlk))
 		return -1;
 
-	iprint("segreclaim\n");
+	DBG("segreclaim\n");
 	lock(&segcache);
 	s = segvictim(&segcache);
 	if(s == nil){
 		unlock(&segcache);
 		qunlock(&segcache.reclaimlk);
-		print("segreclaim: no unused segs\n");
+		DBG("segreclaim: no unused segs\n");
 		return -1;
 	}
 	segcache.nreclaims++;
@@ -723,7 +724,7 @@ forkseg(Proc *p, int segno, int share)
 	if(s->ref > 1){
 		DBG("forkseg flush pid %d s %N sref %d %s %#p\n",
 			up->pid, s->cpath, s->ref, segtypename[s->type&SG_TYPE], s->base);
-		procflushseg(s);
+		procflushseg(s, s->base, s->top);
 	}
 	poperror();
 	qunlock(&s->lk);
@@ -822,7 +823,7 @@ mfreeseg(Segment *s, uintptr start, uintptr top)
 out:
 	/* flush this seg in all other processes */
 	if(s->ref > 1)
-		procflushseg(s);
+		procflushseg(s, start, top);
 
 	/* free the pages */
 	for(pg = list; pg != nil; pg = list){